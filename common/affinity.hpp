@@ -0,0 +1,227 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <fstream>
+#include "platform.hpp"
+
+#if TARGET_PLATFORM == PLATFORM_WINDOWS
+#include <windows.h>
+#elif TARGET_PLATFORM == PLATFORM_LINUX
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+class affinity
+{
+public:
+    // pin a thread to a set of logical cpus, empty cpus does nothing
+    static bool bind(std::thread::native_handle_type handle, const std::vector<int>& cpus)
+    {
+        if (cpus.empty())
+        {
+            return true;
+        }
+#if TARGET_PLATFORM == PLATFORM_WINDOWS
+        DWORD_PTR mask = 0;
+        for (auto cpu : cpus)
+        {
+            if (cpu >= 0 && cpu < static_cast<int>(sizeof(DWORD_PTR) * 8))
+            {
+                mask |= (static_cast<DWORD_PTR>(1) << cpu);
+            }
+        }
+        return mask != 0 && SetThreadAffinityMask(static_cast<HANDLE>(handle), mask) != 0;
+#elif TARGET_PLATFORM == PLATFORM_LINUX
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (auto cpu : cpus)
+        {
+            if (cpu >= 0 && cpu < CPU_SETSIZE)
+            {
+                CPU_SET(cpu, &set);
+            }
+        }
+        return pthread_setaffinity_np(handle, sizeof(set), &set) == 0;
+#else
+        (void)handle;
+        return false;
+#endif
+    }
+
+    static bool bind_current(const std::vector<int>& cpus)
+    {
+        if (cpus.empty())
+        {
+            return true;
+        }
+#if TARGET_PLATFORM == PLATFORM_WINDOWS
+        return bind(GetCurrentThread(), cpus);
+#elif TARGET_PLATFORM == PLATFORM_LINUX
+        return bind(pthread_self(), cpus);
+#else
+        return false;
+#endif
+    }
+
+    // remember the cpus the process may run on, e.g. restricted with taskset.
+    // call from the main thread at startup, before any thread is pinned
+    static bool save_process_cpus()
+    {
+#if TARGET_PLATFORM == PLATFORM_LINUX
+        auto& saved = process_cpus();
+        saved.valid = sched_getaffinity(0, sizeof(saved.set), &saved.set) == 0;
+        return saved.valid;
+#else
+        return true;
+#endif
+    }
+
+    // let the calling thread run on the cpus of the process again, undoes an inherited pin
+    static bool unbind_current()
+    {
+#if TARGET_PLATFORM == PLATFORM_WINDOWS
+        DWORD_PTR process = 0;
+        DWORD_PTR system = 0;
+        if (!GetProcessAffinityMask(GetCurrentProcess(), &process, &system))
+        {
+            return false;
+        }
+        return SetThreadAffinityMask(GetCurrentThread(), process) != 0;
+#elif TARGET_PLATFORM == PLATFORM_LINUX
+        auto& saved = process_cpus();
+        return saved.valid && pthread_setaffinity_np(pthread_self(), sizeof(saved.set), &saved.set) == 0;
+#else
+        return false;
+#endif
+    }
+
+    // numa node of a logical cpu, -1 if unknown
+    static int cpu_node(int cpu)
+    {
+        if (cpu < 0)
+        {
+            return -1;
+        }
+#if TARGET_PLATFORM == PLATFORM_WINDOWS
+        UCHAR node = 0;
+        if (cpu < 256 && GetNumaProcessorNode(static_cast<UCHAR>(cpu), &node) && node != 0xFF)
+        {
+            return node;
+        }
+#elif TARGET_PLATFORM == PLATFORM_LINUX
+        for (int node = 0; node < max_nodes; ++node)
+        {
+            auto cpus = numa_node_cpus(node);
+            if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end())
+            {
+                return node;
+            }
+        }
+#endif
+        return -1;
+    }
+
+    // memory the calling thread touches first is taken from numa node when it has free pages
+    static bool prefer_node(int node)
+    {
+        if (node < 0)
+        {
+            return true;
+        }
+#if TARGET_PLATFORM == PLATFORM_WINDOWS
+        // windows already allocates from the node of the cpu the thread runs on
+        return true;
+#elif TARGET_PLATFORM == PLATFORM_LINUX
+        // MPOL_PREFERRED, set_mempolicy without depending on libnuma
+        constexpr int mpol_preferred = 1;
+        constexpr unsigned long bits = sizeof(unsigned long) * 8;
+        std::vector<unsigned long> mask(static_cast<size_t>(node) / bits + 1, 0);
+        mask[static_cast<size_t>(node) / bits] |= 1UL << (static_cast<size_t>(node) % bits);
+        return syscall(SYS_set_mempolicy, mpol_preferred, mask.data(), mask.size() * bits + 1) == 0;
+#else
+        return false;
+#endif
+    }
+
+    // logical cpus of a numa node, empty if unknown
+    static std::vector<int> numa_node_cpus(int node)
+    {
+        std::vector<int> res;
+        if (node < 0)
+        {
+            return res;
+        }
+#if TARGET_PLATFORM == PLATFORM_WINDOWS
+        ULONGLONG mask = 0;
+        if (GetNumaNodeProcessorMask(static_cast<UCHAR>(node), &mask))
+        {
+            for (int i = 0; i < 64; ++i)
+            {
+                if (mask & (1ULL << i))
+                {
+                    res.emplace_back(i);
+                }
+            }
+        }
+#elif TARGET_PLATFORM == PLATFORM_LINUX
+        // cpulist format: 0-5,12-17
+        std::ifstream ifs("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string list;
+        if (!std::getline(ifs, list))
+        {
+            return res;
+        }
+
+        size_t pos = 0;
+        while (pos < list.size())
+        {
+            auto end = list.find(',', pos);
+            if (end == std::string::npos)
+            {
+                end = list.size();
+            }
+
+            auto range = list.substr(pos, end - pos);
+            auto dash = range.find('-');
+            try
+            {
+                int first = std::stoi(range.substr(0, dash));
+                int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+                for (int i = first; i <= last; ++i)
+                {
+                    res.emplace_back(i);
+                }
+            }
+            catch (const std::exception&)
+            {
+                res.clear();
+                return res;
+            }
+            pos = end + 1;
+        }
+#endif
+        return res;
+    }
+
+private:
+    // node ids cpu_node looks through
+    static constexpr int max_nodes = 64;
+
+#if TARGET_PLATFORM == PLATFORM_LINUX
+    struct saved_cpus
+    {
+        bool valid = false;
+        cpu_set_t set;
+    };
+
+    static saved_cpus& process_cpus()
+    {
+        static saved_cpus saved;
+        return saved;
+    }
+#endif
+};
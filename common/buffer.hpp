@@ -6,7 +6,10 @@
 #include <type_traits>
 #include <string>
 #include <cstring>
+#include <algorithm>
 #include <iostream>
+#include "intrusive_ptr.hpp"
+#include "slab.hpp"
 
 template<typename ValueType>
 class buffer_iterator
@@ -233,7 +236,7 @@ private:
     pointer _Ptr;
 };
 
-class buffer
+class buffer : public intrusive_refcount
 {
 public:
     using iterator = buffer_iterator<char>;
@@ -242,8 +245,13 @@ public:
     using pointer = typename iterator::pointer;
     using const_pointer = typename const_iterator::pointer;
 
-    // buffer default size
-    constexpr static size_t   STACK_CAPACITY = 256 - 4 * sizeof(size_t) - sizeof(std::unique_ptr<value_type[]>);
+    // sizeof(buffer), one slab size class
+    constexpr static size_t object_size = 128;
+
+    // bytes stored inside the object, what is left of object_size after the other members
+    constexpr static size_t STACK_CAPACITY = object_size
+        - ((sizeof(intrusive_refcount) + 2 * sizeof(uint32_t) + alignof(size_t) - 1) & ~(alignof(size_t) - 1))
+        - 3 * sizeof(size_t) - sizeof(pointer);
 
     enum seek_origin
     {
@@ -255,31 +263,65 @@ public:
     buffer(size_t capacity = STACK_CAPACITY, uint32_t headreserved = 0)
         : flag_(0)
         , headreserved_(headreserved)
-        , capacity_(sizeof(stack_data_))
-        , readpos_(headreserved)
-        , writepos_(headreserved)
-        , stack_data_()
+        , capacity_(STACK_CAPACITY)
+        , readpos_(0)
+        , writepos_(0)
+        , heap_data_(nullptr)
     {
         if (capacity + headreserved > capacity_)
         {
-            check_space(capacity);
+            grow(capacity + headreserved);
         }
+        readpos_ = writepos_ = headreserved;
     }
 
     buffer(const buffer& other) = delete;
 
     buffer& operator=(const buffer& other) = delete;
 
-    buffer(buffer &&) = default;
+    buffer(buffer&& other) noexcept
+    {
+        take(other);
+    }
+
+    buffer& operator=(buffer&& other) noexcept
+    {
+        if (this != &other)
+        {
+            slab_allocator::deallocate(heap_data_);
+            take(other);
+        }
+        return *this;
+    }
+
+    ~buffer()
+    {
+        slab_allocator::deallocate(heap_data_);
+    }
 
-    buffer& operator=(buffer &&) = default;
+    // the object itself comes from the slab too
+    static void* operator new(size_t size)
+    {
+        size_t usable = 0;
+        return slab_allocator::allocate(size, usable);
+    }
 
+    static void operator delete(void* p) noexcept
+    {
+        slab_allocator::deallocate(p);
+    }
+
+    // keeps the current storage when it is large enough
     void init(size_t capacity = STACK_CAPACITY, uint32_t headreserved = 0)
     {
-        readpos_ = headreserved;
-        writepos_ = headreserved;
+        readpos_ = 0;
+        writepos_ = 0;
         headreserved_ = headreserved;
-        check_space(capacity);
+        if (capacity + headreserved > capacity_)
+        {
+            grow(capacity + headreserved);
+        }
+        readpos_ = writepos_ = headreserved;
         flag_ = 0;
     }
 
@@ -447,33 +489,28 @@ public:
             return;
         }
 
-        if (writeablesize() + readpos_ < need + headreserved_)
+        // slide the readable bytes back to the reserved head when at least half of the
+        // storage was consumed, each byte is moved at most once per halving
+        size_t readable = size();
+        if (readpos_ > headreserved_ && readable <= capacity_ / 2
+            && headreserved_ + readable + need <= capacity_)
         {
-            auto required_size = writepos_ + need;
-            required_size = next_pow2(required_size);
-            if (!heap_data_)
-            {
-                heap_data_.reset(new char[required_size]);
-                memcpy(heap_data_.get(), stack_data_, writepos_);
-            }
-            else
-            {
-                std::unique_ptr < char[] > new_heap_data(new char[required_size]);
-                memcpy(new_heap_data.get(), heap_data_.get(), writepos_);
-                heap_data_.swap(new_heap_data);
-            }
-            capacity_ = required_size;
-        }
-        else
-        {
-            size_t readable = size();
             if (readable != 0)
             {
-                memcpy(data_() + headreserved_, data_() + readpos_, readable);
+                memmove(data_() + headreserved_, data_() + readpos_, readable);
             }
             readpos_ = headreserved_;
             writepos_ = readpos_ + readable;
+            return;
         }
+
+        // the first heap block is sized from the request, later ones at least double
+        auto required_size = std::min(readpos_, static_cast<size_t>(headreserved_)) + readable + need;
+        if (nullptr != heap_data_ && required_size < capacity_ * 2)
+        {
+            required_size = capacity_ * 2;
+        }
+        grow(required_size);
     }
 
     size_t writeablesize() const
@@ -483,28 +520,54 @@ public:
     }
 
 protected:
-    size_t next_pow2(size_t x)
-    {
-        if (!(x & (x - 1)))
+    // move to a block of at least required_size, only the readable bytes are copied.
+    // they stay at readpos_ unless it is past the reserved head, so bytes written in front are kept
+    void grow(size_t required_size)
+    {
+        size_t usable = 0;
+        auto data = static_cast<pointer>(slab_allocator::allocate(required_size, usable));
+        size_t readable = size();
+        auto readpos = std::min(readpos_, static_cast<size_t>(headreserved_));
+        if (readable != 0)
         {
-            return x;
+            memcpy(data + readpos, data_() + readpos_, readable);
         }
-        x |= x >> 1;
-        x |= x >> 2;
-        x |= x >> 4;
-        x |= x >> 8;
-        x |= x >> 16;
-        return x + 1;
+        slab_allocator::deallocate(heap_data_);
+        heap_data_ = data;
+        capacity_ = usable;
+        readpos_ = readpos;
+        writepos_ = readpos + readable;
+    }
+
+    void take(buffer& other) noexcept
+    {
+        flag_ = other.flag_;
+        headreserved_ = other.headreserved_;
+        capacity_ = other.capacity_;
+        readpos_ = other.readpos_;
+        writepos_ = other.writepos_;
+        heap_data_ = other.heap_data_;
+        if (nullptr == heap_data_)
+        {
+            memcpy(stack_data_, other.stack_data_, writepos_);
+        }
+
+        other.flag_ = 0;
+        other.headreserved_ = 0;
+        other.capacity_ = STACK_CAPACITY;
+        other.readpos_ = 0;
+        other.writepos_ = 0;
+        other.heap_data_ = nullptr;
     }
 
     pointer data_() noexcept
     {
-        return (!heap_data_) ? stack_data_ : heap_data_.get();
+        return (nullptr == heap_data_) ? stack_data_ : heap_data_;
     }
 
     const_pointer data_() const noexcept
     {
-        return (!heap_data_) ? stack_data_ : heap_data_.get();
+        return (nullptr == heap_data_) ? stack_data_ : heap_data_;
     }
 
 protected:
@@ -518,7 +581,10 @@ protected:
     // write position
     size_t writepos_;
 
-    std::unique_ptr<value_type[]> heap_data_;
+    // slab block, nullptr while the data fits stack_data_
+    pointer heap_data_;
 
     value_type stack_data_[STACK_CAPACITY];
 };
+
+static_assert(sizeof(buffer) == buffer::object_size, "buffer::STACK_CAPACITY does not fill buffer::object_size");
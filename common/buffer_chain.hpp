@@ -0,0 +1,218 @@
+#pragma once
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
+#include "buffer.hpp"
+
+// a payload kept as a list of buffers. appending never moves bytes already written,
+// so large payloads are built and consumed segment by segment instead of being regrown.
+class buffer_chain : public intrusive_refcount
+{
+public:
+    using buffer_ptr = intrusive_ptr<buffer>;
+
+    // capacity of the segments the chain allocates, the largest slab size class
+    static constexpr size_t segment_size = 64 * 1024;
+
+    // appended buffers from this size are linked as segments, smaller ones are copied
+    static constexpr size_t link_size = 4 * 1024;
+
+    buffer_chain() = default;
+
+    buffer_chain(const buffer_chain&) = delete;
+
+    buffer_chain& operator=(const buffer_chain&) = delete;
+
+    void append(const char* data, size_t len)
+    {
+        while (len != 0)
+        {
+            if (!tail_owned_ || segments_.back()->writeablesize() == 0)
+            {
+                segments_.emplace_back(buffer_ptr::make(segment_size, 0));
+                tail_owned_ = true;
+            }
+
+            auto& tail = segments_.back();
+            auto n = std::min(len, tail->writeablesize());
+            tail->write_back(data, n);
+            size_ += n;
+            data += n;
+            len -= n;
+        }
+    }
+
+    // the chain shares buf, it must not be written to afterwards
+    void append(buffer_ptr buf)
+    {
+        if (!buf || buf->size() == 0)
+        {
+            return;
+        }
+
+        if (buf->size() < link_size)
+        {
+            append(buf->data(), buf->size());
+            return;
+        }
+
+        size_ += buf->size();
+        segments_.emplace_back(std::move(buf));
+        tail_owned_ = false;
+    }
+
+    // total readable size
+    size_t size() const noexcept
+    {
+        return size_;
+    }
+
+    bool empty() const noexcept
+    {
+        return size_ == 0;
+    }
+
+    const std::vector<buffer_ptr>& segments() const noexcept
+    {
+        return segments_;
+    }
+
+    // copy into one buffer, a chain of one segment returns it as is and never writes to it again
+    buffer_ptr flatten(uint32_t headreserved = 0)
+    {
+        if (segments_.size() == 1 && segments_.front()->size() == size_)
+        {
+            tail_owned_ = false;
+            return segments_.front();
+        }
+
+        auto res = buffer_ptr::make(size_, headreserved);
+        for (auto& seg : segments_)
+        {
+            res->write_back(seg->data(), seg->size());
+        }
+        return res;
+    }
+
+    // hand the segments to writer(data, len) in order without copying them,
+    // stop at the first one it does not take completely
+    template<typename Writer>
+    bool write(Writer&& writer) const
+    {
+        for (auto& seg : segments_)
+        {
+            if (seg->size() != 0 && !writer(seg->data(), seg->size()))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void clear()
+    {
+        segments_.clear();
+        size_ = 0;
+        tail_owned_ = false;
+    }
+
+private:
+    std::vector<buffer_ptr> segments_;
+    size_t size_ = 0;
+    // the last segment was allocated by the chain and can be written to
+    bool tail_owned_ = false;
+};
+
+// reads a chain like buffer_view reads contiguous memory, values may straddle segments
+class buffer_chain_view
+{
+public:
+    explicit buffer_chain_view(const buffer_chain& chain)
+        : segments_(chain.segments())
+        , remain_(chain.size())
+    {
+        settle();
+    }
+
+    buffer_chain_view(const buffer_chain_view&) = delete;
+    buffer_chain_view& operator=(const buffer_chain_view&) = delete;
+
+    template<typename T>
+    bool read(T* Outdata, size_t count = 1) noexcept
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "type T must be trivially copyable");
+        if (nullptr == Outdata || 0 == count)
+        {
+            return false;
+        }
+
+        size_t n = sizeof(T) * count;
+        if (n > remain_)
+        {
+            return false;
+        }
+
+        auto out = reinterpret_cast<char*>(Outdata);
+        while (n != 0)
+        {
+            auto len = std::min(n, contiguous());
+            memcpy(out, data(), len);
+            out += len;
+            n -= len;
+            advance(len);
+        }
+        return true;
+    }
+
+    // current position, contiguous() bytes are readable from it
+    const char* data() const
+    {
+        return (index_ < segments_.size()) ? segments_[index_]->data() + offset_ : nullptr;
+    }
+
+    size_t contiguous() const
+    {
+        return (index_ < segments_.size()) ? segments_[index_]->size() - offset_ : 0;
+    }
+
+    // readable size
+    size_t size() const
+    {
+        return remain_;
+    }
+
+    void skip(size_t len)
+    {
+        while (len != 0 && remain_ != 0)
+        {
+            auto n = std::min(len, contiguous());
+            advance(n);
+            len -= n;
+        }
+    }
+
+private:
+    void advance(size_t n)
+    {
+        offset_ += n;
+        remain_ -= n;
+        settle();
+    }
+
+    // step over consumed and empty segments
+    void settle()
+    {
+        while (index_ < segments_.size() && offset_ == segments_[index_]->size())
+        {
+            ++index_;
+            offset_ = 0;
+        }
+    }
+
+private:
+    const std::vector<buffer_chain::buffer_ptr>& segments_;
+    size_t index_ = 0;
+    size_t offset_ = 0;
+    size_t remain_ = 0;
+};
@@ -113,6 +113,12 @@ public:
         return (size_ - readpos_);
     }
 
+    // bytes readable from data() in one piece, same as buffer_chain_view
+    size_t contiguous() const
+    {
+        return size();
+    }
+
     void skip(size_t len)
     {
         if (len < size())
@@ -90,6 +90,16 @@ public:
         return false;
     }
 
+    template<typename Handler>
+    void for_each(Handler&& handler) const
+    {
+        std::shared_lock lck(lock_);
+        for (const auto& it : data_)
+        {
+            handler(it.first, it.second);
+        }
+    }
+
 private:
     mutable Lock lock_;
     std::unordered_map<Key, Value> data_;
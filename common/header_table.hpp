@@ -0,0 +1,107 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <string>
+#include "hash.hpp"
+#include "macro.hpp"
+
+// process-wide table of interned message headers. a message carrying an interned header stores
+// its small id instead of the string. interning is append-only, lookups take no lock.
+class header_table
+{
+public:
+    // ids are 1..max_count-1, 0 means not interned
+    static constexpr uint16_t max_count = 4096;
+
+    static header_table& instance()
+    {
+        // never destroyed, messages may outlive static destruction
+        static auto obj = new header_table();
+        return *obj;
+    }
+
+    header_table(const header_table&) = delete;
+
+    header_table& operator=(const header_table&) = delete;
+
+    // id of s, added if missing, 0 when the table is full
+    uint16_t intern(string_view_t s)
+    {
+        if (s.empty())
+        {
+            return 0;
+        }
+
+        auto id = find(s);
+        if (id != 0)
+        {
+            return id;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        // interned by another thread meanwhile
+        id = find(s);
+        if (id != 0 || count_ == max_count)
+        {
+            return id;
+        }
+
+        id = count_++;
+        names_[id].store(new std::string(s.data(), s.size()), std::memory_order_release);
+        auto i = probe_start(s);
+        while (slots_[i].load(std::memory_order_relaxed) != 0)
+        {
+            i = (i + 1) & slot_mask;
+        }
+        slots_[i].store(id, std::memory_order_release);
+        return id;
+    }
+
+    // 0 if s is not interned
+    uint16_t find(string_view_t s) const
+    {
+        if (s.empty())
+        {
+            return 0;
+        }
+
+        for (auto i = probe_start(s);; i = (i + 1) & slot_mask)
+        {
+            auto id = slots_[i].load(std::memory_order_acquire);
+            if (id == 0)
+            {
+                return 0;
+            }
+            auto name = names_[id].load(std::memory_order_acquire);
+            if (*name == s)
+            {
+                return id;
+            }
+        }
+    }
+
+    string_view_t name(uint16_t id) const
+    {
+        auto name = (id < max_count) ? names_[id].load(std::memory_order_acquire) : nullptr;
+        return (nullptr != name) ? string_view_t{ *name } : string_view_t{};
+    }
+
+private:
+    header_table() = default;
+
+    // at most half of the slots are used, probes stay short and always end on an empty slot
+    static constexpr size_t slot_count = max_count * 2;
+
+    static constexpr size_t slot_mask = slot_count - 1;
+
+    static size_t probe_start(string_view_t s)
+    {
+        return hash_range(s.begin(), s.end()) & slot_mask;
+    }
+
+private:
+    std::mutex mutex_;
+    uint16_t count_ = 1;
+    std::atomic<const std::string*> names_[max_count] = {};
+    std::atomic<uint16_t> slots_[slot_count] = {};
+};
@@ -0,0 +1,181 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+// reference count embedded in the object, moves and copies of the object do not carry it
+class intrusive_refcount
+{
+    template<class T>
+    friend class intrusive_ptr;
+
+public:
+    intrusive_refcount() = default;
+
+    intrusive_refcount(const intrusive_refcount&) noexcept
+    {
+    }
+
+    intrusive_refcount& operator=(const intrusive_refcount&) noexcept
+    {
+        return *this;
+    }
+
+    uint32_t use_count() const noexcept
+    {
+        return count_.load(std::memory_order_acquire);
+    }
+
+private:
+    void add_ref() noexcept
+    {
+        count_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // true when the last reference went away
+    bool release_ref() noexcept
+    {
+        // the only owner: nobody can take another reference meanwhile, so skip the atomic decrement
+        if (count_.load(std::memory_order_acquire) == 1)
+        {
+            count_.store(0, std::memory_order_relaxed);
+            return true;
+        }
+        return count_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+
+private:
+    std::atomic<uint32_t> count_ = 0;
+};
+
+// shared_ptr without the separate control block, T derives from intrusive_refcount.
+// a raw pointer can be wrapped again at any time, it only takes one more reference.
+template<class T>
+class intrusive_ptr
+{
+public:
+    intrusive_ptr() = default;
+
+    intrusive_ptr(std::nullptr_t) noexcept
+    {
+    }
+
+    explicit intrusive_ptr(T* p) noexcept
+        : ptr_(p)
+    {
+        if (nullptr != ptr_)
+        {
+            ptr_->add_ref();
+        }
+    }
+
+    intrusive_ptr(const intrusive_ptr& other) noexcept
+        : intrusive_ptr(other.ptr_)
+    {
+    }
+
+    intrusive_ptr(intrusive_ptr&& other) noexcept
+        : ptr_(other.ptr_)
+    {
+        other.ptr_ = nullptr;
+    }
+
+    ~intrusive_ptr()
+    {
+        reset();
+    }
+
+    intrusive_ptr& operator=(const intrusive_ptr& other) noexcept
+    {
+        intrusive_ptr(other).swap(*this);
+        return *this;
+    }
+
+    intrusive_ptr& operator=(intrusive_ptr&& other) noexcept
+    {
+        intrusive_ptr(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    intrusive_ptr& operator=(std::nullptr_t) noexcept
+    {
+        reset();
+        return *this;
+    }
+
+    // the new object starts with one reference, taken without an atomic read-modify-write
+    template<typename... Args>
+    static intrusive_ptr make(Args&&... args)
+    {
+        intrusive_ptr res;
+        res.ptr_ = new T(std::forward<Args>(args)...);
+        res.ptr_->count_.store(1, std::memory_order_relaxed);
+        return res;
+    }
+
+    void reset() noexcept
+    {
+        if (nullptr != ptr_)
+        {
+            if (ptr_->release_ref())
+            {
+                delete ptr_;
+            }
+            ptr_ = nullptr;
+        }
+    }
+
+    void swap(intrusive_ptr& other) noexcept
+    {
+        std::swap(ptr_, other.ptr_);
+    }
+
+    T* get() const noexcept
+    {
+        return ptr_;
+    }
+
+    T* operator->() const noexcept
+    {
+        return ptr_;
+    }
+
+    T& operator*() const noexcept
+    {
+        return *ptr_;
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return nullptr != ptr_;
+    }
+
+    long use_count() const noexcept
+    {
+        return (nullptr != ptr_) ? static_cast<long>(ptr_->use_count()) : 0;
+    }
+
+    friend bool operator==(const intrusive_ptr& a, std::nullptr_t) noexcept
+    {
+        return nullptr == a.ptr_;
+    }
+
+    friend bool operator==(std::nullptr_t, const intrusive_ptr& a) noexcept
+    {
+        return nullptr == a.ptr_;
+    }
+
+    friend bool operator!=(const intrusive_ptr& a, std::nullptr_t) noexcept
+    {
+        return nullptr != a.ptr_;
+    }
+
+    friend bool operator!=(std::nullptr_t, const intrusive_ptr& a) noexcept
+    {
+        return nullptr != a.ptr_;
+    }
+
+private:
+    T* ptr_ = nullptr;
+};
@@ -129,6 +129,11 @@ public:
         }
     }
 
+    std::thread::native_handle_type native_handle()
+    {
+        return thread_.native_handle();
+    }
+
     void wait()
     {
         if (state_.load() == state::exited)
@@ -1,29 +1,36 @@
 #pragma once
 #include "common/buffer.hpp"
+#include "common/buffer_chain.hpp"
+#include "common/header_table.hpp"
+#include "common/per_thread.hpp"
 #include "core/config.hpp"
 
+class message_pool;
+
 class message
 {
+    friend class message_pool;
+
+    friend struct message_deleter;
+
 public:
+    // headers up to this size are stored in the message itself
+    static constexpr size_t header_inline_size = 32;
+
     static buffer_ptr_t create_buffer(size_t capacity = 64, uint32_t headreserved = BUFFER_HEAD_RESERVED)
     {
-        return std::make_shared<buffer>(capacity, headreserved);
+        return buffer_ptr_t::make(capacity, headreserved);
     }
 
-    static message_ptr_t create(size_t capacity = 64, uint32_t headreserved = BUFFER_HEAD_RESERVED)
-    {
-        return std::make_unique<message>(capacity, headreserved);
-    }
+    // taken from the pool of the calling thread, together with the buffer it kept
+    static message_ptr_t create(size_t capacity = 64, uint32_t headreserved = BUFFER_HEAD_RESERVED);
 
     template<typename Buffer,std::enable_if_t<std::is_same_v<std::decay_t<Buffer>,buffer_ptr_t>,int> = 0>
-    static message_ptr_t create(Buffer&& v)
-    {
-        return std::make_unique<message>(std::forward<Buffer>(v));
-    }
+    static message_ptr_t create(Buffer&& v);
 
     message(size_t capacity = 64, uint32_t headreserved = 0)
     {
-        data_ = std::make_shared<buffer>(capacity, headreserved);
+        data_ = buffer_ptr_t::make(capacity, headreserved);
     }
 
     template<typename Buffer, std::enable_if_t<std::is_same_v<std::decay_t<Buffer>, buffer_ptr_t>, int> = 0>
@@ -61,31 +68,59 @@ public:
         return receiver_;
     }
 
+    // an interned header is stored as its id only, see header_table
     void set_header(string_view_t header)
     {
         if (header.size() != 0)
         {
-            if (!header_)
+            header_id_ = header_table::instance().find(header);
+            if (header_id_ != 0)
+            {
+                header_size_ = 0;
+                return;
+            }
+
+            header_size_ = static_cast<uint32_t>(header.size());
+            if (header.size() <= header_inline_size)
             {
-                header_ = std::make_unique<std::string>(header.data(), header.size());
+                memcpy(header_inline_, header.data(), header.size());
             }
             else
             {
-                header_->clear();
-                header_->assign(header.data(), header.size());
+                header_long_.assign(header.data(), header.size());
             }
         }
     }
 
+    void set_header_id(uint16_t id)
+    {
+        header_id_ = id;
+        header_size_ = 0;
+    }
+
+    // 0 when the header is not interned
+    uint16_t header_id() const
+    {
+        return header_id_;
+    }
+
     string_view_t header() const
     {
-        if (nullptr == header_)
+        if (header_id_ != 0)
+        {
+            return header_table::instance().name(header_id_);
+        }
+        else if (header_size_ == 0)
         {
             return string_view_t{};
         }
+        else if (header_size_ <= header_inline_size)
+        {
+            return string_view_t{ header_inline_, header_size_ };
+        }
         else
         {
-            return string_view_t{ header_->data(),header_->size() };
+            return string_view_t{ header_long_.data(), header_long_.size() };
         }
     }
 
@@ -119,6 +154,7 @@ public:
         return subtype_;
     }
 
+    // contiguous payload, empty for a chained message
     string_view_t bytes() const
     {
         if (!data_)
@@ -149,9 +185,21 @@ public:
         return data_ ? data_->data() : nullptr;
     }
 
+    // whole payload, including the chain
     size_t size() const
     {
-        return data_ ? data_->size():0;
+        return (data_ ? data_->size() : 0) + (chain_ ? chain_->size() : 0);
+    }
+
+    // a payload too large to keep contiguous travels as a chain, see buffer_chain
+    void set_chain(buffer_chain_ptr_t chain)
+    {
+        chain_ = std::move(chain);
+    }
+
+    const buffer_chain_ptr_t& chain() const
+    {
+        return chain_;
     }
 
     operator const buffer_ptr_t&() const
@@ -164,6 +212,23 @@ public:
         return data_ ? data_.get() : nullptr;
     }
 
+    // the buffer to modify in place. a buffer other messages share, e.g. a multicast payload,
+    // is copied first, their readers never see it change
+    buffer* unique_buffer()
+    {
+        if (data_ && data_.use_count() > 1)
+        {
+            auto copy = buffer_ptr_t::make(data_->size(), BUFFER_HEAD_RESERVED);
+            copy->write_back(data_->data(), data_->size());
+            if (data_->has_flag(buffer_flag::broadcast))
+            {
+                copy->set_flag(buffer_flag::broadcast);
+            }
+            data_ = std::move(copy);
+        }
+        return get_buffer();
+    }
+
     bool broadcast() const
     {
         return data_?data_->has_flag(buffer_flag::broadcast):false;
@@ -185,11 +250,9 @@ public:
         sender_ = 0;
         receiver_ = 0;
         sessionid_ = 0;
-
-        if (header_)
-        {
-            header_->clear();
-        }
+        header_id_ = 0;
+        header_size_ = 0;
+        chain_.reset();
 
         if (data_)
         {
@@ -200,9 +263,167 @@ public:
 private:
     uint8_t type_ = 0;
     uint8_t subtype_ = 0;
+    uint16_t header_id_ = 0;
     uint32_t sender_ = 0;
     uint32_t receiver_ = 0;
     int32_t sessionid_ = 0;
-    std::unique_ptr<std::string> header_;
+    uint32_t header_size_ = 0;
+    char header_inline_[header_inline_size];
+    // headers longer than header_inline_size, keeps its capacity while the message is pooled
+    std::string header_long_;
     buffer_ptr_t data_;
+    buffer_chain_ptr_t chain_;
+    // pool that created the message, nullptr if the thread had none
+    message_pool* pool_ = nullptr;
+    // link of the free and return lists
+    message* next_ = nullptr;
+};
+
+// free messages of one thread. a message goes back to the pool that created it,
+// other threads hand it over through a lock-free return list the owner takes in one exchange.
+class message_pool
+{
+    friend class per_thread<message_pool>;
+
+public:
+    // free messages kept by one pool, the rest are deleted
+    static constexpr size_t max_free = 4096;
+
+    // a pooled message keeps its buffer up to this capacity
+    static constexpr size_t max_buffer = 64 * 1024;
+
+    // pool of the calling thread, nullptr while the thread exits
+    static message_pool* local()
+    {
+        return per_thread<message_pool>::local();
+    }
+
+    // with_buffer prefers a message that kept its buffer, otherwise only a bare one is taken,
+    // so a kept buffer is never thrown away for one the caller brings
+    message* take(bool with_buffer)
+    {
+        if (nullptr == bare_ && (!with_buffer || nullptr == full_))
+        {
+            reclaim();
+        }
+
+        auto& list = (with_buffer && nullptr != full_) ? full_ : bare_;
+        auto m = list;
+        if (nullptr != m)
+        {
+            list = m->next_;
+            m->next_ = nullptr;
+            --free_count_;
+        }
+        return m;
+    }
+
+    // owner thread only
+    void put(message* m)
+    {
+        if (free_count_ >= max_free)
+        {
+            delete m;
+            return;
+        }
+
+        auto& list = m->data_ ? full_ : bare_;
+        m->next_ = list;
+        list = m;
+        ++free_count_;
+    }
+
+    // any thread
+    void give_back(message* m)
+    {
+        auto head = returned_.load(std::memory_order_relaxed);
+        do
+        {
+            m->next_ = head;
+        } while (!returned_.compare_exchange_weak(head, m, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+private:
+    message_pool() = default;
+
+    void reclaim()
+    {
+        auto m = returned_.exchange(nullptr, std::memory_order_acquire);
+        while (nullptr != m)
+        {
+            auto next = m->next_;
+            put(m);
+            m = next;
+        }
+    }
+
+private:
+    // messages that kept their buffer, and messages without one
+    message* full_ = nullptr;
+    message* bare_ = nullptr;
+    size_t free_count_ = 0;
+    std::atomic<message*> returned_ = nullptr;
 };
+
+inline message_ptr_t message::create(size_t capacity, uint32_t headreserved)
+{
+    auto pool = message_pool::local();
+    auto m = (nullptr != pool) ? pool->take(true) : nullptr;
+    if (nullptr == m)
+    {
+        m = new message(capacity, headreserved);
+        m->pool_ = pool;
+    }
+    else if (m->data_)
+    {
+        m->data_->init(capacity, headreserved);
+    }
+    else
+    {
+        m->data_ = buffer_ptr_t::make(capacity, headreserved);
+    }
+    return message_ptr_t{ m };
+}
+
+template<typename Buffer, std::enable_if_t<std::is_same_v<std::decay_t<Buffer>, buffer_ptr_t>, int>>
+inline message_ptr_t message::create(Buffer&& v)
+{
+    auto pool = message_pool::local();
+    auto m = (nullptr != pool) ? pool->take(false) : nullptr;
+    if (nullptr == m)
+    {
+        m = new message(std::forward<Buffer>(v));
+        m->pool_ = pool;
+    }
+    else
+    {
+        m->data_ = std::forward<Buffer>(v);
+    }
+    return message_ptr_t{ m };
+}
+
+inline void message_deleter::operator()(message* m) const
+{
+    auto pool = m->pool_;
+    if (nullptr == pool)
+    {
+        delete m;
+        return;
+    }
+
+    // a buffer somebody else still holds, or a big one, is not kept
+    if (m->data_ && (m->data_.use_count() != 1 || m->data_->max_size() > message_pool::max_buffer))
+    {
+        m->data_.reset();
+    }
+    m->reset();
+
+    if (pool == message_pool::local())
+    {
+        pool->put(m);
+    }
+    else
+    {
+        pool->give_back(m);
+    }
+}
@@ -0,0 +1,158 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <cassert>
+#include <utility>
+#include "noncopyable.hpp"
+
+// lock-free multi-producer single-consumer queue (intrusive linked list, Dmitry Vyukov's algorithm).
+// push_back/size may be called from any thread, swap/try_pop/consume only from the consumer thread.
+template<class T, template <typename Elem, typename = std::allocator<Elem>> class Container = std::vector>
+class mpsc_queue : public noncopyable
+{
+    struct node
+    {
+        node() = default;
+
+        template<typename TData>
+        explicit node(TData&& v)
+            : value(std::forward<TData>(v))
+        {
+        }
+
+        std::atomic<node*> next = nullptr;
+        T value{};
+    };
+
+public:
+    using container_type = Container<T>;
+
+    mpsc_queue()
+        : head_(new node())
+        , size_(0)
+    {
+        tail_ = head_.load(std::memory_order_relaxed);
+    }
+
+    ~mpsc_queue()
+    {
+        T tmp;
+        while (try_pop(tmp))
+        {
+        }
+        delete tail_;
+    }
+
+    // return the queue size after push, 1 means the queue was empty
+    template<typename TData>
+    size_t push_back(TData&& x)
+    {
+        auto n = new node(std::forward<TData>(x));
+        auto res = size_.fetch_add(1, std::memory_order_acq_rel) + 1;
+        auto prev = head_.exchange(n, std::memory_order_acq_rel);
+        prev->next.store(n, std::memory_order_release);
+        return res;
+    }
+
+    // link every element of items with a single exchange, items is left empty.
+    // return the queue size after push, equal to the batch size means the queue was empty
+    size_t push_batch(container_type& items)
+    {
+        if (items.empty())
+        {
+            return size();
+        }
+
+        node* first = nullptr;
+        node* last = nullptr;
+        for (auto& v : items)
+        {
+            auto n = new node(std::move(v));
+            if (nullptr == first)
+            {
+                first = n;
+            }
+            else
+            {
+                // published by the release store below
+                last->next.store(n, std::memory_order_relaxed);
+            }
+            last = n;
+        }
+
+        auto count = items.size();
+        items.clear();
+        auto res = size_.fetch_add(count, std::memory_order_acq_rel) + count;
+        auto prev = head_.exchange(last, std::memory_order_acq_rel);
+        prev->next.store(first, std::memory_order_release);
+        return res;
+    }
+
+    bool try_pop(T& t)
+    {
+        auto tail = tail_;
+        auto next = tail->next.load(std::memory_order_acquire);
+        if (nullptr == next)
+        {
+            return false;
+        }
+        t = std::move(next->value);
+        tail_ = next;
+        delete tail;
+        size_.fetch_sub(1, std::memory_order_acq_rel);
+        return true;
+    }
+
+    // pop every linked element, return the number consumed.
+    // a producer preempted between its two stores is picked up by the next call.
+    template<typename Handler>
+    size_t consume(Handler&& handler)
+    {
+        size_t n = 0;
+        auto tail = tail_;
+        auto next = tail->next.load(std::memory_order_acquire);
+        while (nullptr != next)
+        {
+            handler(std::move(next->value));
+            delete tail;
+            tail = next;
+            next = tail->next.load(std::memory_order_acquire);
+            ++n;
+        }
+        tail_ = tail;
+        if (n != 0)
+        {
+            size_.fetch_sub(n, std::memory_order_acq_rel);
+        }
+        return n;
+    }
+
+    // same as concurrent_queue::swap: other receives everything queued, in order
+    void swap(container_type& other)
+    {
+        assert(other.empty());
+        consume([&other](T&& v) {
+            other.push_back(std::move(v));
+        });
+    }
+
+    // an element is linked and can be consumed, consumer thread only.
+    // false while size() is not 0 means producers are between their two stores
+    bool ready() const
+    {
+        return nullptr != tail_->next.load(std::memory_order_acquire);
+    }
+
+    // elements pushed and not consumed yet, including the ones still being linked
+    size_t size() const
+    {
+        return size_.load(std::memory_order_acquire);
+    }
+
+private:
+    std::atomic<node*> head_;
+    node* tail_;
+    std::atomic<size_t> size_;
+};
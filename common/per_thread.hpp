@@ -0,0 +1,75 @@
+#pragma once
+#include <mutex>
+#include <vector>
+
+// one T per thread. a T is never destroyed: when its thread exits it is handed to the next
+// new thread, so objects that still refer to it, e.g. memory freed later, stay valid.
+// T needs a default constructor accessible to per_thread.
+template<class T>
+class per_thread
+{
+    struct registry
+    {
+        std::mutex mutex;
+        std::vector<T*> idle;
+    };
+
+    struct holder
+    {
+        holder()
+            : value(acquire())
+        {
+        }
+
+        ~holder()
+        {
+            exiting_ = true;
+            release(value);
+        }
+
+        T* value;
+    };
+
+public:
+    // the calling thread's T, nullptr while the thread exits
+    static T* local()
+    {
+        if (exiting_)
+        {
+            return nullptr;
+        }
+        thread_local holder h;
+        return h.value;
+    }
+
+private:
+    // never destroyed, threads may still exit while statics are torn down
+    static registry& get_registry()
+    {
+        static auto r = new registry();
+        return *r;
+    }
+
+    static T* acquire()
+    {
+        auto& r = get_registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        if (!r.idle.empty())
+        {
+            auto p = r.idle.back();
+            r.idle.pop_back();
+            return p;
+        }
+        return new T();
+    }
+
+    static void release(T* p)
+    {
+        auto& r = get_registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.idle.emplace_back(p);
+    }
+
+private:
+    inline static thread_local bool exiting_ = false;
+};
@@ -0,0 +1,205 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include "per_thread.hpp"
+
+// power of two size classes cached per thread. a block goes back to the cache of the thread
+// that allocated it, other threads hand it over through a lock-free return list.
+// blocks are allocated one by one, so what exceeds a class budget returns to the system
+// once a spike is over.
+class slab_allocator
+{
+    struct block
+    {
+        // owner cache, nullptr for blocks not cached
+        void* owner;
+        // size class while allocated, next free block while cached
+        union
+        {
+            size_t klass;
+            block* next;
+        };
+    };
+
+    static constexpr size_t header_size = (sizeof(block) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+public:
+    static constexpr size_t min_class_shift = 6;
+
+    static constexpr size_t max_class_shift = 16;
+
+    static constexpr size_t class_count = max_class_shift - min_class_shift + 1;
+
+    // bytes of free blocks one cache keeps for a size class, at least min_free blocks
+    static constexpr size_t max_free_bytes = 256 * 1024;
+
+    static constexpr size_t min_free = 4;
+
+    // usable size of the block serving size bytes, larger than the max class is allocated as is
+    static size_t fit(size_t size) noexcept
+    {
+        auto k = class_of(size);
+        return (k < class_count) ? class_size(k) : size;
+    }
+
+    // usable is set to the block size, which may exceed size
+    static void* allocate(size_t size, size_t& usable)
+    {
+        auto k = class_of(size);
+        if (k >= class_count)
+        {
+            usable = size;
+            return to_data(make_block(size, nullptr, k));
+        }
+
+        usable = class_size(k);
+        auto c = per_thread<cache>::local();
+        if (nullptr == c)
+        {
+            return to_data(make_block(usable, nullptr, k));
+        }
+
+        auto b = c->take(k);
+        if (nullptr == b)
+        {
+            b = make_block(usable, c, k);
+        }
+        else
+        {
+            b->klass = k;
+        }
+        return to_data(b);
+    }
+
+    static void deallocate(void* p) noexcept
+    {
+        if (nullptr == p)
+        {
+            return;
+        }
+
+        auto b = to_block(p);
+        auto owner = static_cast<cache*>(b->owner);
+        if (nullptr == owner)
+        {
+            ::operator delete(b);
+        }
+        else if (owner == per_thread<cache>::local())
+        {
+            owner->put(b);
+        }
+        else
+        {
+            owner->give_back(b);
+        }
+    }
+
+private:
+    class cache
+    {
+        friend class per_thread<cache>;
+
+    public:
+        block* take(size_t k)
+        {
+            if (nullptr == free_[k])
+            {
+                reclaim();
+            }
+
+            auto b = free_[k];
+            if (nullptr != b)
+            {
+                free_[k] = b->next;
+                --free_count_[k];
+            }
+            return b;
+        }
+
+        // owner thread only
+        void put(block* b)
+        {
+            auto k = b->klass;
+            if (free_count_[k] >= max_free(k))
+            {
+                ::operator delete(b);
+                return;
+            }
+            b->next = free_[k];
+            free_[k] = b;
+            ++free_count_[k];
+        }
+
+        // any thread, the block keeps its class until the owner reclaims it
+        void give_back(block* b)
+        {
+            auto head = returned_.load(std::memory_order_relaxed);
+            do
+            {
+                b->owner = head;
+            } while (!returned_.compare_exchange_weak(head, b, std::memory_order_release, std::memory_order_relaxed));
+        }
+
+    private:
+        cache() = default;
+
+        static size_t max_free(size_t k)
+        {
+            auto n = max_free_bytes >> (k + min_class_shift);
+            return (n < min_free) ? min_free : n;
+        }
+
+        void reclaim()
+        {
+            auto b = returned_.exchange(nullptr, std::memory_order_acquire);
+            while (nullptr != b)
+            {
+                auto next = static_cast<block*>(b->owner);
+                b->owner = this;
+                put(b);
+                b = next;
+            }
+        }
+
+    private:
+        block* free_[class_count] = {};
+        size_t free_count_[class_count] = {};
+        // returned blocks are linked through owner, klass must stay readable
+        std::atomic<block*> returned_ = nullptr;
+    };
+
+    static size_t class_of(size_t size) noexcept
+    {
+        size_t k = 0;
+        while (k < class_count && class_size(k) < size)
+        {
+            ++k;
+        }
+        return k;
+    }
+
+    static constexpr size_t class_size(size_t k) noexcept
+    {
+        return static_cast<size_t>(1) << (k + min_class_shift);
+    }
+
+    static block* make_block(size_t size, cache* owner, size_t k)
+    {
+        auto b = static_cast<block*>(::operator new(header_size + size));
+        b->owner = owner;
+        b->klass = k;
+        return b;
+    }
+
+    static void* to_data(block* b) noexcept
+    {
+        return reinterpret_cast<char*>(b) + header_size;
+    }
+
+    static block* to_block(void* p) noexcept
+    {
+        return reinterpret_cast<block*>(static_cast<char*>(p) - header_size);
+    }
+};
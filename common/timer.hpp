@@ -83,6 +83,7 @@ public:
         : stop_(false)
         , tick_(0)
         , previous_tick_(0)
+        , count_(0)
         , now_(detail::millseconds)
     {
         wheels_.emplace_back();
@@ -154,6 +155,31 @@ public:
         return old_tick;
     }
 
+    // milliseconds until update() has something to do, -1 if no timer is pending.
+    // keys parked in outer wheels are reported at the next wheel-0 round, when they cascade
+    int64_t next_expire()
+    {
+        if (stop_ || count_ == 0)
+        {
+            return -1;
+        }
+
+        auto& wheel = wheels_[0];
+        int64_t ticks = wheel.size() - wheel.next_slot();
+        for (int64_t i = 0; i < ticks; ++i)
+        {
+            if (!wheel[static_cast<uint8_t>(wheel.next_slot() + i)].empty())
+            {
+                ticks = i + 1;
+                break;
+            }
+        }
+
+        int64_t elapsed = (previous_tick_ == 0) ? 0 : (now_() - previous_tick_);
+        auto res = ticks * PRECISION - tick_ - elapsed;
+        return (res > 0) ? res : 0;
+    }
+
     void stop_all_timer()
     {
         stop_ = true;
@@ -206,6 +232,7 @@ protected:
             if (slot_count < wheel.size())
             {
                 wheel[slot].push_back(key);
+                ++count_;
                 break;
             }
             slot_count /= wheel.size();
@@ -218,6 +245,7 @@ protected:
         {
             auto key = expires.front();
             expires.pop_front();
+            --count_;
             timer_id_t id = static_cast<timer_id_t>(key >> TIMERID_SHIT);
             child_t* child = static_cast<child_t*>(this);
             int32_t duration = child->on_timer(id);
@@ -232,6 +260,8 @@ private:
     bool stop_;
     int64_t tick_;
     int64_t previous_tick_;
+    // keys in all wheels
+    size_t count_;
     std::function<int64_t()> now_;
     std::vector <timer_wheel_t> wheels_;
 };
@@ -1,12 +1,27 @@
 #pragma once
 #include "common/macro.hpp"
+#include "common/intrusive_ptr.hpp"
 
 constexpr int32_t WORKER_ID_SHIFT = 24;
-constexpr int64_t UPDATE_INTERVAL = 10; // ms
+constexpr uint32_t MAX_WORKER_NUM = 0xFF; // worker ids are 8 bits, 0 is invalid
+// low 24 bits of a service id: generation | slot, raise the slot bits for more services per worker
+constexpr uint32_t SERVICE_SLOT_BITS = 16;
+constexpr uint32_t SERVICE_SLOT_MASK = (1u << SERVICE_SLOT_BITS) - 1;
+constexpr uint32_t SERVICE_GENERATION_MASK = (1u << (WORKER_ID_SHIFT - SERVICE_SLOT_BITS)) - 1;
+static_assert(SERVICE_SLOT_BITS < WORKER_ID_SHIFT, "service ids need generation bits");
 constexpr int32_t BUFFER_HEAD_RESERVED = 14;// max : websocket header  max  len
 
-DECLARE_UNIQUE_PTR(message);
-DECLARE_SHARED_PTR(buffer);
+class message;
+// hands the message back to the pool of the thread that created it, see message_pool
+struct message_deleter
+{
+    void operator()(message* m) const;
+};
+using message_ptr_t = std::unique_ptr<message, message_deleter>;
+class buffer;
+using buffer_ptr_t = intrusive_ptr<buffer>;
+class buffer_chain;
+using buffer_chain_ptr_t = intrusive_ptr<buffer_chain>;
 DECLARE_UNIQUE_PTR(service);
 
 constexpr uint8_t PTYPE_UNKNOWN = 0;
@@ -26,6 +41,10 @@ constexpr  string_view_t STR_LF = "\n";
 constexpr  string_view_t STR_CRLF = "\r\n";
 constexpr  string_view_t STR_DCRLF = "\r\n\r\n";
 
+// system headers, interned by the router
+// topic of service exits, published when a service is removed
+constexpr string_view_t HEADER_EXIT = "exit";
+
 enum class buffer_flag :uint8_t
 {
     pack_size = 1 << 0,
@@ -0,0 +1,159 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include "common/string.hpp"
+#include "config.hpp"
+
+enum class mailbox_policy : uint8_t
+{
+    drop_newest,
+    drop_oldest,
+    reject,
+    block,
+};
+
+// bounded mailbox of one service, producers count messages in, the hosting worker counts them out
+class mailbox
+{
+public:
+    // milliseconds a blocked sender waits before the message is dropped
+    static constexpr int64_t block_timeout = 1000;
+
+    mailbox(size_t limit, mailbox_policy policy)
+        : limit_(limit)
+        , policy_(policy)
+    {
+    }
+
+    static bool parse_policy(string_view_t s, mailbox_policy& policy)
+    {
+        if (s.empty() || iequal_string(s, string_view_t{ "drop_newest" }))
+        {
+            policy = mailbox_policy::drop_newest;
+        }
+        else if (iequal_string(s, string_view_t{ "drop_oldest" }))
+        {
+            policy = mailbox_policy::drop_oldest;
+        }
+        else if (iequal_string(s, string_view_t{ "reject" }))
+        {
+            policy = mailbox_policy::reject;
+        }
+        else if (iequal_string(s, string_view_t{ "block" }))
+        {
+            policy = mailbox_policy::block;
+        }
+        else
+        {
+            return false;
+        }
+        return true;
+    }
+
+    static const char* policy_name(mailbox_policy policy)
+    {
+        switch (policy)
+        {
+        case mailbox_policy::drop_oldest:
+            return "drop_oldest";
+        case mailbox_policy::reject:
+            return "reject";
+        case mailbox_policy::block:
+            return "block";
+        default:
+            return "drop_newest";
+        }
+    }
+
+    size_t limit() const
+    {
+        return limit_;
+    }
+
+    mailbox_policy policy() const
+    {
+        return policy_;
+    }
+
+    bool full() const
+    {
+        return size_.load(std::memory_order_acquire) >= limit_;
+    }
+
+    // drop_oldest lets producers overrun the limit, the consumer drops the excess
+    bool overrun() const
+    {
+        return size_.load(std::memory_order_acquire) > limit_;
+    }
+
+    void push()
+    {
+        auto n = size_.fetch_add(1, std::memory_order_acq_rel) + 1;
+        auto hw = high_water_.load(std::memory_order_relaxed);
+        while (n > hw && !high_water_.compare_exchange_weak(hw, n, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    void pop()
+    {
+        // seq_cst pairs with wait(): either the waiter sees the smaller size or we see it waiting
+        size_.fetch_sub(1);
+        if (waiters_.load() != 0)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cv_.notify_all();
+        }
+    }
+
+    // block a thread that is not a worker until the mailbox has room, at most timeout milliseconds.
+    // stop is checked whenever a pop wakes us, false when it timed out or stop returned true
+    template<typename Stop>
+    bool wait(int64_t timeout, Stop&& stop)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+        std::unique_lock<std::mutex> lock(mutex_);
+        waiters_.fetch_add(1);
+        bool room = cv_.wait_until(lock, deadline, [this, &stop] {
+            return size_.load() < limit_ || stop();
+        });
+        waiters_.fetch_sub(1);
+        return room && size_.load() < limit_;
+    }
+
+    void drop()
+    {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    size_t size() const
+    {
+        return size_.load(std::memory_order_acquire);
+    }
+
+    size_t high_water() const
+    {
+        return high_water_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t dropped() const
+    {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+private:
+    const size_t limit_;
+    const mailbox_policy policy_;
+    std::atomic<size_t> size_ = 0;
+    std::atomic<size_t> high_water_ = 0;
+    // dropped or rejected messages
+    std::atomic<uint64_t> dropped_ = 0;
+    // senders of other threads blocked in wait, pop only takes the lock when there are some
+    std::atomic<uint32_t> waiters_ = 0;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
+
+DECLARE_SHARED_PTR(mailbox);
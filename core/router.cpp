@@ -1,7 +1,9 @@
 #include "router.h"
+#include <algorithm>
 #include "common/string.hpp"
 #include "common/hash.hpp"
 #include "common/time.hpp"
+#include "common/rapidjson_helper.hpp"
 #include "worker.h"
 #include "message.hpp"
 #include "server.h"
@@ -9,10 +11,17 @@
 
 router::router(std::vector<std::unique_ptr<worker>>& workers, logger* logger)
     : next_workerid_(0)
+    , worker_num_(0)
     , workers_(workers)
+    , pools_{ std::string{} }
+    , mailbox_count_(0)
+    , host_count_(0)
+    , traffic_sample_(0)
+    , next_colocate_(0)
     , logger_(logger)
     , server_(nullptr)
 {
+    header_table::instance().intern(HEADER_EXIT);
 }
 
 void router::new_service(std::string service_type, std::string config, bool unique, int32_t workerid, uint32_t creatorid, int32_t sessionid)
@@ -25,15 +34,43 @@ void router::new_service(std::string service_type, std::string config, bool uniq
     }
     else
     {
-        worker = next_worker();
+        std::string pool;
+        rapidjson::Document doc;
+        doc.Parse(config.data(), config.size());
+        if (!doc.HasParseError() && doc.IsObject())
+        {
+            pool = rapidjson::get_value<std::string>(&doc, "pool");
+        }
+
+        auto idx = pool_index(pool);
+        if (idx < 0)
+        {
+            CONSOLE_ERROR(get_logger(), "new service [%s] failed: worker pool '%s' not found.", service_type.data(), pool.data());
+            if (0 != sessionid)
+            {
+                response(creatorid, std::string_view{}, "0", sessionid);
+            }
+            return;
+        }
+        worker = next_worker(static_cast<uint8_t>(idx));
+        if (nullptr == worker)
+        {
+            CONSOLE_ERROR(get_logger(), "new service [%s] failed: worker pool '%s' has no worker left.", service_type.data(), pool.data());
+            if (0 != sessionid)
+            {
+                response(creatorid, std::string_view{}, "0", sessionid);
+            }
+            return;
+        }
     }
     worker->add_service(std::move(service_type), std::move(config), unique, creatorid, sessionid);
 }
 
 void router::remove_service(uint32_t serviceid, uint32_t sender, int32_t sessionid)
 {
-    auto workerid = worker_id(serviceid);
-    if (workerid_valid(workerid))
+    // the host, the allocating worker may have ended already while its services live on
+    auto workerid = host_id(serviceid);
+    if (workerid_valid(workerid) && !get_worker(workerid)->stoped())
     {
         get_worker(workerid)->remove_service(serviceid, sender, sessionid);
     }
@@ -43,6 +80,32 @@ void router::remove_service(uint32_t serviceid, uint32_t sender, int32_t session
     }
 }
 
+void router::migrate_service(uint32_t serviceid, int32_t workerid)
+{
+    auto origin = worker_id(serviceid);
+    if (!workerid_valid(origin) || get_worker(origin)->stoped())
+    {
+        CONSOLE_ERROR(get_logger(), "migrate service [%X] failed: invalid serviceid.", serviceid);
+        return;
+    }
+
+    worker* target = workerid_valid(workerid) ? get_worker(workerid) : next_worker(get_worker(origin)->pool());
+    if (nullptr == target)
+    {
+        CONSOLE_ERROR(get_logger(), "migrate service [%X] failed: no worker left in the pool.", serviceid);
+        return;
+    }
+
+    if (!target->shared() || target->stoped())
+    {
+        CONSOLE_ERROR(get_logger(), "migrate service [%X] failed: worker %u is not shared or stopped.", serviceid, target->id());
+        return;
+    }
+
+    // the worker that allocated the id knows where the service lives
+    get_worker(origin)->migrate_service(serviceid, target->id());
+}
+
 void router::send_message(message_ptr_t&& m) const
 {
     if (m->type() == PTYPE_UNKNOWN)
@@ -57,14 +120,141 @@ void router::send_message(message_ptr_t&& m) const
         return;
     }
 
-    auto workerid = worker_id(m->receiver());
+    auto workerid = host_id(m->receiver());
     if (!workerid_valid(workerid))
     {
         CONSOLE_ERROR(get_logger(), "invalid message receiver serviceid %X", m->receiver());
         return;
     }
 
-    get_worker(workerid)->send(std::forward<message_ptr_t>(m));
+    auto w = get_worker(workerid);
+    // a retired worker whose thread ended hosts nothing and forwards nothing
+    if (w->stoped())
+    {
+        if (m->sender() != 0 && server_->get_state() < state::stopping)
+        {
+            m->set_sessionid(-m->sessionid());
+            response(m->sender(), "router::send_message ", format("[%X] attempt send to dead service [%X].", m->sender(), m->receiver()), m->sessionid(), PTYPE_ERROR);
+        }
+        return;
+    }
+
+    if (mailbox_count_.load(std::memory_order_acquire) != 0 && !admit(m, w))
+    {
+        return;
+    }
+
+    if (traffic_sample_.load(std::memory_order_relaxed) != 0)
+    {
+        record_traffic(m.get(), w);
+    }
+
+    w->send(std::forward<message_ptr_t>(m));
+}
+
+void router::record_traffic(const message* m, const worker* w) const
+{
+    static thread_local uint32_t counter = 0;
+    auto sample = traffic_sample_.load(std::memory_order_relaxed);
+    if (sample == 0 || (++counter % sample) != 0)
+    {
+        return;
+    }
+
+    // only hops between workers are worth co-locating
+    auto cw = worker::current();
+    if (m->sender() == 0 || m->broadcast() || nullptr == cw || cw == w)
+    {
+        return;
+    }
+
+    auto key = (static_cast<uint64_t>(m->sender()) << 32) | m->receiver();
+    std::lock_guard<spin_lock> lock(traffic_lock_);
+    auto iter = traffic_.find(key);
+    if (iter == traffic_.end())
+    {
+        if (traffic_.size() >= max_traffic_pairs)
+        {
+            return;
+        }
+        iter = traffic_.emplace(key, traffic_stat{}).first;
+    }
+    iter->second.messages += sample;
+    iter->second.bytes += static_cast<uint64_t>(m->size()) * sample;
+}
+
+bool router::admit(message_ptr_t& m, worker* w) const
+{
+    // control messages are never bounded, a full mailbox must still hear about errors and exit
+    if (m->broadcast() || m->type() == PTYPE_SYSTEM || m->type() == PTYPE_ERROR)
+    {
+        return true;
+    }
+
+    mailbox_ptr_t mb;
+    if (!mailboxes_.try_get_value(m->receiver(), mb))
+    {
+        return true;
+    }
+
+    // keep the order behind messages this worker already holds for the receiver
+    if (mb->policy() == mailbox_policy::block)
+    {
+        if (auto cw = worker::current(); nullptr != cw && cw != w && cw->blocked(m->receiver()))
+        {
+            cw->block(std::move(m), mb, w);
+            return false;
+        }
+    }
+
+    if (mb->full())
+    {
+        switch (mb->policy())
+        {
+        case mailbox_policy::drop_oldest:
+            break;
+        case mailbox_policy::reject:
+        {
+            mb->drop();
+            if (m->sender() != 0)
+            {
+                m->set_sessionid(-m->sessionid());
+                response(m->sender(), "router::send_message ", format("[%X] mailbox of service [%X] is full.", m->sender(), m->receiver()), m->sessionid(), PTYPE_ERROR);
+            }
+            return false;
+        }
+        case mailbox_policy::block:
+        {
+            // the receiver's own worker can not drain while blocked
+            if (w->is_current())
+            {
+                break;
+            }
+
+            // a worker holds the message and keeps serving its other services meanwhile
+            if (auto cw = worker::current(); nullptr != cw)
+            {
+                cw->block(std::move(m), mb, w);
+                return false;
+            }
+
+            // other threads sleep until the receiver's worker pops
+            if (!mb->wait(mailbox::block_timeout, [this] { return server_->get_state() >= state::stopping; }))
+            {
+                mb->drop();
+                CONSOLE_WARN(get_logger(), "message to service [%X] dropped: mailbox blocked over %" PRId64 "ms.", m->receiver(), mailbox::block_timeout);
+                return false;
+            }
+            break;
+        }
+        default:
+            mb->drop();
+            return false;
+        }
+    }
+
+    mb->push();
+    return true;
 }
 
 void router::send(uint32_t sender, uint32_t receiver, buffer_ptr_t data, string_view_t header, int32_t sessionid, uint8_t type) const
@@ -82,10 +272,27 @@ void router::send(uint32_t sender, uint32_t receiver, buffer_ptr_t data, string_
     send_message(std::move(m));
 }
 
+void router::send_chain(uint32_t sender, uint32_t receiver, buffer_chain_ptr_t chain, string_view_t header, int32_t sessionid, uint8_t type) const
+{
+    sessionid = -sessionid;
+    message_ptr_t m = message::create(buffer_ptr_t{});
+    m->set_chain(std::move(chain));
+    m->set_sender(sender);
+    m->set_receiver(receiver);
+    if (header.size() != 0)
+    {
+        m->set_header(header);
+    }
+    m->set_type(type);
+    m->set_sessionid(sessionid);
+    send_message(std::move(m));
+}
+
 void router::broadcast(uint32_t sender, const buffer_ptr_t& buf, string_view_t header, uint8_t type)
 {
-    for (auto& worker : workers_)
+    for (uint32_t i = 0, n = worker_num(); i < n; ++i)
     {
+        auto& worker = workers_[i];
         auto m = message::create(buf);
         m->set_broadcast(true);
         m->set_header(header);
@@ -95,6 +302,187 @@ void router::broadcast(uint32_t sender, const buffer_ptr_t& buf, string_view_t h
     }
 }
 
+void router::multicast(uint32_t sender, const std::vector<uint32_t>& receivers, const buffer_ptr_t& buf, string_view_t header, uint8_t type) const
+{
+    if (type == PTYPE_UNKNOWN)
+    {
+        CONSOLE_ERROR(get_logger(), "invalid message type.");
+        return;
+    }
+
+    // index is the hosting worker id, reused by every multicast of this thread
+    static thread_local std::vector<std::vector<message_ptr_t>> batches;
+
+    auto header_id = header_table::instance().find(header);
+    for (auto receiver : receivers)
+    {
+        auto workerid = host_id(receiver);
+        if (receiver == 0 || !workerid_valid(workerid))
+        {
+            CONSOLE_ERROR(get_logger(), "invalid message receiver serviceid %X", receiver);
+            continue;
+        }
+
+        auto m = message::create(buf);
+        m->set_sender(sender);
+        m->set_receiver(receiver);
+        if (header_id != 0)
+        {
+            m->set_header_id(header_id);
+        }
+        else
+        {
+            m->set_header(header);
+        }
+        m->set_type(type);
+
+        auto w = get_worker(workerid);
+        if (mailbox_count_.load(std::memory_order_acquire) != 0 && !admit(m, w))
+        {
+            continue;
+        }
+
+        if (traffic_sample_.load(std::memory_order_relaxed) != 0)
+        {
+            record_traffic(m.get(), w);
+        }
+
+        // workers may be added meanwhile
+        if (workerid >= batches.size())
+        {
+            batches.resize(static_cast<size_t>(workerid) + 1);
+        }
+        batches[workerid].emplace_back(std::move(m));
+    }
+
+    for (uint32_t id = 1; id < batches.size(); ++id)
+    {
+        if (auto& batch = batches[id]; !batch.empty())
+        {
+            get_worker(id)->send_batch(batch);
+        }
+    }
+}
+
+bool router::subscribe(uint32_t serviceid, const std::string& topic)
+{
+    auto workerid = worker_id(serviceid);
+    if (topic.empty() || !workerid_valid(workerid))
+    {
+        return false;
+    }
+
+    // published messages carry the topic as their header, an id is cheaper to compare
+    header_table::instance().intern(topic);
+
+    std::unique_lock lck(topics_lock_);
+    auto& by_worker = topics_[topic];
+    if (by_worker.size() <= workerid)
+    {
+        by_worker.resize(static_cast<size_t>(workerid) + 1);
+    }
+
+    auto& subscribers = by_worker[workerid];
+    if (std::find(subscribers.begin(), subscribers.end(), serviceid) != subscribers.end())
+    {
+        return false;
+    }
+    subscribers.emplace_back(serviceid);
+    subscriptions_[serviceid].emplace_back(topic);
+    return true;
+}
+
+bool router::unsubscribe(uint32_t serviceid, const std::string& topic)
+{
+    std::unique_lock lck(topics_lock_);
+    if (!remove_subscriber(serviceid, topic))
+    {
+        return false;
+    }
+
+    auto iter = subscriptions_.find(serviceid);
+    if (iter != subscriptions_.end())
+    {
+        auto& topics = iter->second;
+        topics.erase(std::find(topics.begin(), topics.end(), topic));
+        if (topics.empty())
+        {
+            subscriptions_.erase(iter);
+        }
+    }
+    return true;
+}
+
+void router::unsubscribe_all(uint32_t serviceid)
+{
+    std::unique_lock lck(topics_lock_);
+    auto iter = subscriptions_.find(serviceid);
+    if (iter == subscriptions_.end())
+    {
+        return;
+    }
+
+    for (auto& topic : iter->second)
+    {
+        remove_subscriber(serviceid, topic);
+    }
+    subscriptions_.erase(iter);
+}
+
+bool router::remove_subscriber(uint32_t serviceid, const std::string& topic)
+{
+    auto iter = topics_.find(topic);
+    auto workerid = worker_id(serviceid);
+    if (iter == topics_.end() || iter->second.size() <= workerid)
+    {
+        return false;
+    }
+
+    auto& subscribers = iter->second[workerid];
+    auto pos = std::find(subscribers.begin(), subscribers.end(), serviceid);
+    if (pos == subscribers.end())
+    {
+        return false;
+    }
+
+    // order of delivery between subscribers is not kept anyway
+    *pos = subscribers.back();
+    subscribers.pop_back();
+
+    bool empty = std::all_of(iter->second.begin(), iter->second.end(), [](const std::vector<uint32_t>& v) {
+        return v.empty();
+    });
+    if (empty)
+    {
+        topics_.erase(iter);
+    }
+    return true;
+}
+
+size_t router::publish(uint32_t sender, const std::string& topic, const buffer_ptr_t& buf, uint8_t type) const
+{
+    // a copy, sending may block on a full mailbox and must not hold the lock
+    static thread_local std::vector<uint32_t> receivers;
+    receivers.clear();
+    {
+        std::shared_lock lck(topics_lock_);
+        auto iter = topics_.find(topic);
+        if (iter == topics_.end())
+        {
+            return 0;
+        }
+
+        for (auto& subscribers : iter->second)
+        {
+            receivers.insert(receivers.end(), subscribers.begin(), subscribers.end());
+        }
+    }
+
+    // multicast groups them by hosting worker and pushes each group at once
+    multicast(sender, receivers, buf, topic, type);
+    return receivers.size();
+}
+
 bool router::register_service(const std::string& type, register_func f)
 {
     auto ret = regservices_.emplace(type, f);
@@ -189,29 +577,291 @@ uint32_t router::worker_id(uint32_t serviceid) const
     return (serviceid >> WORKER_ID_SHIFT) & 0xFF;
 }
 
+uint32_t router::host_id(uint32_t serviceid) const
+{
+    uint8_t host = 0;
+    if (host_count_.load(std::memory_order_acquire) != 0 && hosts_.try_get_value(serviceid, host))
+    {
+        return host;
+    }
+    return worker_id(serviceid);
+}
+
+void router::set_host(uint32_t serviceid, uint32_t workerid)
+{
+    if (workerid == worker_id(serviceid))
+    {
+        remove_host(serviceid);
+        return;
+    }
+
+    if (hosts_.try_set(serviceid, static_cast<uint8_t>(workerid)))
+    {
+        host_count_.fetch_add(1, std::memory_order_release);
+    }
+    else
+    {
+        hosts_.set(serviceid, static_cast<uint8_t>(workerid));
+    }
+}
+
+void router::remove_host(uint32_t serviceid)
+{
+    if (hosts_.erase(serviceid))
+    {
+        host_count_.fetch_sub(1, std::memory_order_release);
+    }
+}
+
 worker* router::get_worker(uint32_t workerid) const
 {
     --workerid;
     return workers_[workerid].get();
 }
 
-worker* router::next_worker()
+std::string router::worker_info() const
+{
+    std::string res;
+    res.append("[");
+    for (uint32_t i = 0, n = worker_num(); i < n; ++i)
+    {
+        auto& worker = workers_[i];
+        if (res.size() > 1)
+        {
+            res.append(",");
+        }
+        res.append(format(R"({"id":%u,"pool":"%s","shared":%s,"retired":%s,"services":%u,"load":%u,"mailbox":%zu,"memory":%zu,"quantum_exceeded":%)" PRIu64 R"(,"deferred":%)" PRIu64 "}",
+            worker->id(),
+            pools_[worker->pool()].data(),
+            worker->shared() ? "true" : "false",
+            worker->retired() ? "true" : "false",
+            worker->count(),
+            worker->cpu_load(),
+            worker->mailbox_size(),
+            worker->memory(),
+            worker->quantum_exceeded(),
+            worker->deferred()));
+    }
+    res.append("]");
+    return res;
+}
+
+mailbox_ptr_t router::set_mailbox(uint32_t serviceid, size_t limit, mailbox_policy policy)
+{
+    auto mb = std::make_shared<mailbox>(limit, policy);
+    if (mailboxes_.try_set(serviceid, mb))
+    {
+        mailbox_count_.fetch_add(1, std::memory_order_release);
+    }
+    else
+    {
+        mailboxes_.set(serviceid, mb);
+    }
+    return mb;
+}
+
+void router::remove_mailbox(uint32_t serviceid)
+{
+    if (mailboxes_.erase(serviceid))
+    {
+        mailbox_count_.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+std::string router::mailbox_info() const
+{
+    std::string res;
+    res.append("[");
+    mailboxes_.for_each([&res](uint32_t serviceid, const mailbox_ptr_t& mb) {
+        if (res.size() > 1)
+        {
+            res.append(",");
+        }
+        res.append(format(R"({"serviceid":%u,"limit":%zu,"policy":"%s","size":%zu,"high_water":%zu,"dropped":%)" PRIu64 "}",
+            serviceid,
+            mb->limit(),
+            mailbox::policy_name(mb->policy()),
+            mb->size(),
+            mb->high_water(),
+            mb->dropped()));
+    });
+    res.append("]");
+    return res;
+}
+
+void router::set_traffic_sample(uint32_t n)
+{
+    traffic_sample_.store(n, std::memory_order_relaxed);
+    if (n == 0)
+    {
+        std::lock_guard<spin_lock> lock(traffic_lock_);
+        traffic_.clear();
+    }
+}
+
+std::vector<std::pair<uint64_t, router::traffic_stat>> router::top_traffic(uint32_t top) const
+{
+    std::vector<std::pair<uint64_t, traffic_stat>> res;
+    {
+        std::lock_guard<spin_lock> lock(traffic_lock_);
+        res.assign(traffic_.begin(), traffic_.end());
+    }
+
+    auto n = std::min<size_t>(top, res.size());
+    std::partial_sort(res.begin(), res.begin() + n, res.end(), [](const auto& a, const auto& b) {
+        return a.second.messages > b.second.messages;
+    });
+    res.resize(n);
+    return res;
+}
+
+std::string router::traffic_info(uint32_t top) const
+{
+    std::string res;
+    res.append("[");
+    for (auto& it : top_traffic(top))
+    {
+        if (res.size() > 1)
+        {
+            res.append(",");
+        }
+        res.append(format(R"({"sender":%u,"receiver":%u,"messages":%)" PRIu64 R"(,"bytes":%)" PRIu64 "}",
+            static_cast<uint32_t>(it.first >> 32),
+            static_cast<uint32_t>(it.first),
+            it.second.messages,
+            it.second.bytes));
+    }
+    res.append("]");
+    return res;
+}
+
+uint32_t router::colocate(uint32_t top)
+{
+    uint32_t moves = 0;
+    std::unordered_set<uint32_t> moved;
+    for (auto& it : top_traffic(top))
+    {
+        auto sender = static_cast<uint32_t>(it.first >> 32);
+        auto receiver = static_cast<uint32_t>(it.first);
+        // a service moves once per call, and never away from a partner it just joined
+        if (moved.count(sender) != 0 || moved.count(receiver) != 0)
+        {
+            continue;
+        }
+
+        auto workerid = worker_id(receiver);
+        if (!workerid_valid(workerid) || !workerid_valid(worker_id(sender)))
+        {
+            continue;
+        }
+
+        // moved together by an earlier round, the samples have not faded yet
+        if (host_id(sender) == host_id(receiver))
+        {
+            continue;
+        }
+
+        get_worker(workerid)->colocate(sender, receiver);
+        moved.emplace(sender);
+        moved.emplace(receiver);
+        ++moves;
+    }
+
+    // old traffic fades, so the matrix follows topology changes
+    std::lock_guard<spin_lock> lock(traffic_lock_);
+    for (auto iter = traffic_.begin(); iter != traffic_.end();)
+    {
+        iter->second.messages /= 2;
+        iter->second.bytes /= 2;
+        if (iter->second.messages == 0)
+        {
+            iter = traffic_.erase(iter);
+        }
+        else
+        {
+            ++iter;
+        }
+    }
+    return moves;
+}
+
+void router::colocate_round(int64_t interval, uint32_t top)
 {
-    size_t n = next_workerid_.fetch_add(1);
-    std::vector<uint8_t> free_worker;
-    for (auto& worker : workers_)
+    auto now = time::now();
+    auto due = next_colocate_.load(std::memory_order_relaxed);
+    if (now < due || !next_colocate_.compare_exchange_strong(due, now + interval))
+    {
+        return;
+    }
+
+    if (auto moves = colocate(top); moves != 0)
     {
-        if (worker->shared())
+        CONSOLE_INFO(get_logger(), "colocate round: %u services asked to move next to their peers.", moves);
+    }
+}
+
+worker* router::next_worker(uint8_t pool)
+{
+    // start at a rotating offset, so equally loaded workers take turns
+    auto num = worker_num();
+    auto start = next_workerid_.fetch_add(1);
+    worker* best = nullptr;
+    worker* best_shared = nullptr;
+    uint64_t best_score = 0;
+    uint64_t best_shared_score = 0;
+    for (uint32_t i = 0; i < num; ++i)
+    {
+        auto w = workers_[(start + i) % num].get();
+        if (w->pool() != pool || w->retired())
+        {
+            continue;
+        }
+
+        auto score = placement_score(w);
+        if (nullptr == best || score < best_score)
         {
-            free_worker.emplace_back(worker->id() - 1);
+            best = w;
+            best_score = score;
+        }
+
+        if (w->shared() && (nullptr == best_shared || score < best_shared_score))
+        {
+            best_shared = w;
+            best_shared_score = score;
         }
     }
-    if (!free_worker.empty())
+
+    if (nullptr != best_shared)
     {
-        auto wkid = free_worker[n % free_worker.size()];
-        return workers_[wkid].get();
+        return best_shared;
     }
-    return workers_[n % workers_.size()].get();
+
+    // nullptr when every worker of the pool is retired, never one of another pool
+    return best;
+}
+
+uint64_t router::placement_score(const worker* w)
+{
+    // cpu permille dominates, then one point per 64 queued messages and per 16M of service memory.
+    // load and memory are sampled, so services posted and not created yet are counted too,
+    // otherwise a burst of new services would all land on the same worker
+    uint64_t score = w->cpu_load();
+    score += w->mailbox_size() / 64;
+    score += w->memory() / (16 * 1024 * 1024);
+    score += static_cast<uint64_t>(w->pending()) * pending_cost;
+    return (score << 24) + w->count() + w->pending();
+}
+
+int32_t router::pool_index(string_view_t name) const
+{
+    for (size_t i = 0; i < pools_.size(); ++i)
+    {
+        if (pools_[i] == name)
+        {
+            return static_cast<int32_t>(i);
+        }
+    }
+    return -1;
 }
 
 void router::set_server(server * sv)
@@ -221,5 +871,108 @@ void router::set_server(server * sv)
 
 bool router::workerid_valid(uint32_t workerid) const
 {
-    return workerid > 0 && workerid <= static_cast<uint32_t>(workers_.size());
+    return workerid > 0 && workerid <= worker_num();
+}
+
+uint32_t router::worker_num() const
+{
+    return worker_num_.load(std::memory_order_acquire);
+}
+
+uint32_t router::add_worker(const std::string& pool)
+{
+    auto idx = pool_index(pool);
+    if (idx < 0)
+    {
+        CONSOLE_ERROR(get_logger(), "add worker failed: worker pool '%s' not found.", pool.data());
+        return 0;
+    }
+
+    // a retired worker of the pool that still runs is cheaper than a thread, server::add_worker
+    // restarts one that already ended before it takes a new id
+    worker* w = nullptr;
+    for (uint32_t i = 0, n = worker_num(); i < n; ++i)
+    {
+        if (workers_[i]->pool() == idx && workers_[i]->retired() && workers_[i]->revive())
+        {
+            w = workers_[i].get();
+            break;
+        }
+    }
+
+    if (nullptr == w)
+    {
+        w = server_->add_worker(static_cast<uint8_t>(idx));
+        if (nullptr == w)
+        {
+            return 0;
+        }
+    }
+
+    rebalance(w);
+    return w->id();
+}
+
+bool router::retire_worker(uint32_t workerid)
+{
+    if (!workerid_valid(workerid))
+    {
+        CONSOLE_ERROR(get_logger(), "retire worker %u failed: invalid workerid.", workerid);
+        return false;
+    }
+
+    auto w = get_worker(workerid);
+    if (w->retired() || !w->shared())
+    {
+        CONSOLE_ERROR(get_logger(), "retire worker %u failed: worker is retired or not shared.", workerid);
+        return false;
+    }
+
+    size_t active = 0;
+    for (uint32_t i = 0, n = worker_num(); i < n; ++i)
+    {
+        auto& other = workers_[i];
+        if (other->pool() == w->pool() && !other->retired() && other->shared())
+        {
+            ++active;
+        }
+    }
+
+    if (active < 2)
+    {
+        CONSOLE_ERROR(get_logger(), "retire worker %u failed: it is the last shared worker of its pool.", workerid);
+        return false;
+    }
+
+    w->retire();
+    return true;
+}
+
+void router::rebalance(worker* target)
+{
+    std::vector<worker*> peers;
+    uint32_t total = 0;
+    for (uint32_t i = 0, n = worker_num(); i < n; ++i)
+    {
+        auto w = workers_[i].get();
+        if (w->pool() == target->pool() && !w->retired() && w->shared())
+        {
+            peers.emplace_back(w);
+            total += w->count();
+        }
+    }
+
+    if (peers.empty())
+    {
+        return;
+    }
+
+    auto avg = total / static_cast<uint32_t>(peers.size());
+    for (auto w : peers)
+    {
+        if (w != target && w->count() > avg)
+        {
+            w->shed_services(target->id(), w->count() - avg);
+        }
+    }
 }
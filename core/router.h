@@ -1,14 +1,28 @@
 #pragma once
 #include "common/concurrent_map.hpp"
 #include "common/rwlock.hpp"
+#include "common/spinlock.hpp"
 #include "common/logger.hpp"
 #include "core/worker.h"
+#include "core/mailbox.hpp"
 
 class server;
 class worker;
 
 class router
 {
+    struct traffic_stat
+    {
+        uint64_t messages = 0;
+        uint64_t bytes = 0;
+    };
+
+    // bounds the matrix, pairs beyond it are not tracked until the next decay
+    static constexpr size_t max_traffic_pairs = 65536;
+
+    // cpu permille placement assumes for a service that is posted and not created yet
+    static constexpr uint64_t pending_cost = 100;
+
 public:
     friend class server;
 
@@ -24,12 +38,34 @@ public:
 
     void remove_service(uint32_t serviceid, uint32_t sender, int32_t sessionid);
 
+    // move a service allocated on a shared worker to another one, workerid 0 picks one
+    void migrate_service(uint32_t serviceid, int32_t workerid);
+
     void send_message(message_ptr_t&& msg) const;
 
     void send(uint32_t sender, uint32_t receiver, buffer_ptr_t buf, string_view_t header, int32_t sessionid, uint8_t type) const;
 
+    // send a chained payload without flattening it, the chain must not be appended to afterwards
+    void send_chain(uint32_t sender, uint32_t receiver, buffer_chain_ptr_t chain, string_view_t header, int32_t sessionid, uint8_t type) const;
+
     void broadcast(uint32_t sender, const buffer_ptr_t& buf, string_view_t header, uint8_t type);
 
+    // send buf to every receiver, all messages share it. a receiver that modifies its payload
+    // gets a copy first, see message::unique_buffer.
+    // receivers are grouped by worker, each worker takes its messages in one mailbox push
+    void multicast(uint32_t sender, const std::vector<uint32_t>& receivers, const buffer_ptr_t& buf, string_view_t header, uint8_t type) const;
+
+    // the service receives what is published to topic, the topic name is the message header
+    bool subscribe(uint32_t serviceid, const std::string& topic);
+
+    bool unsubscribe(uint32_t serviceid, const std::string& topic);
+
+    // drop every subscription of a service
+    void unsubscribe_all(uint32_t serviceid);
+
+    // multicast buf to the subscribers of topic, return their number
+    size_t publish(uint32_t sender, const std::string& topic, const buffer_ptr_t& buf, uint8_t type) const;
+
     bool register_service(const std::string& type, register_func func);
 
     service_ptr_t make_service(const std::string& type);
@@ -50,21 +86,104 @@ public:
 
     uint32_t worker_id(uint32_t serviceid) const;
 
+    // worker hosting a service, the one that allocated its id unless it migrated
+    uint32_t host_id(uint32_t serviceid) const;
+
+    // publish where a migrated service lives, the allocating worker means it came home
+    void set_host(uint32_t serviceid, uint32_t workerid);
+
+    void remove_host(uint32_t serviceid);
+
     worker* get_worker(uint32_t workerid) const;
 
+    std::string worker_info() const;
+
+    uint32_t worker_num() const;
+
+    // start one more worker in the pool and move shared services onto it, return its id or 0
+    uint32_t add_worker(const std::string& pool);
+
+    // move every service of a shared worker away, it keeps running as a forwarder
+    bool retire_worker(uint32_t workerid);
+
+    // pick a worker of the pool, shared ones first, retired ones never, nullptr if none is left
+    worker* next_worker(uint8_t pool = 0);
+
+    // bound the mailbox of a service, messages over limit are handled by policy
+    mailbox_ptr_t set_mailbox(uint32_t serviceid, size_t limit, mailbox_policy policy);
+
+    void remove_mailbox(uint32_t serviceid);
+
+    std::string mailbox_info() const;
+
+    // sample one of every n cross-worker messages into the traffic matrix, 0 disables it
+    void set_traffic_sample(uint32_t n);
+
+    // the heaviest cross-worker sender->receiver pairs, estimated from the samples
+    std::string traffic_info(uint32_t top) const;
+
+    // move the senders of the heaviest pairs next to their receivers, then decay the matrix.
+    // return the number of migrations requested
+    uint32_t colocate(uint32_t top);
+
+    // colocate once per interval milliseconds, whichever worker timer comes first runs the round
+    void colocate_round(int64_t interval, uint32_t top);
+
 private:
     void set_server(server* sv);
 
     bool workerid_valid(uint32_t workerid) const;
 
-    worker* next_worker();
+    void record_traffic(const message* m, const worker* w) const;
+
+    // pairs sorted by messages, heaviest first
+    std::vector<std::pair<uint64_t, traffic_stat>> top_traffic(uint32_t top) const;
+
+    // lower is better, allocation free
+    static uint64_t placement_score(const worker* w);
+
+    // even out the services of the pool with a worker that just joined it
+    void rebalance(worker* target);
+
+    // apply the receiver's mailbox policy, false means the message was dropped, rejected
+    // or taken by the sending worker to be sent once the mailbox has room
+    bool admit(message_ptr_t& m, worker* w) const;
+
+    // index of a named pool, empty name is the default pool, -1 if not found
+    int32_t pool_index(string_view_t name) const;
+
+    // caller holds topics_lock_ exclusively
+    bool remove_subscriber(uint32_t serviceid, const std::string& topic);
 
 private:
     std::atomic<uint32_t> next_workerid_;
+    // workers_ has MAX_WORKER_NUM reserved and never shrinks, a slot is
+    // readable from any thread once worker_num_ covers it
+    std::atomic<uint32_t> worker_num_;
     std::vector<std::unique_ptr<worker>>& workers_;
+    // pool names, index 0 is the default pool
+    std::vector<std::string> pools_;
     std::unordered_map<std::string, register_func > regservices_;
     concurrent_map<std::string, std::string, rwlock> env_;
     concurrent_map<std::string, uint32_t, rwlock> unique_services_;
+    // bounded mailboxes, most services have none so the count skips the lookup
+    std::atomic<uint32_t> mailbox_count_;
+    concurrent_map<uint32_t, mailbox_ptr_t, rwlock> mailboxes_;
+    // hosts of migrated services, so senders skip the hop through the allocating worker.
+    // messages sent while a service moves may still be forwarded that way
+    std::atomic<uint32_t> host_count_;
+    concurrent_map<uint32_t, uint8_t, rwlock> hosts_;
+    // sampled cross-worker traffic, key is sender << 32 | receiver
+    std::atomic<uint32_t> traffic_sample_;
+    mutable spin_lock traffic_lock_;
+    mutable std::unordered_map<uint64_t, traffic_stat> traffic_;
+    // time::now() of the next colocate_round
+    std::atomic<int64_t> next_colocate_;
+    // subscribers of each topic, index is the worker id of the service id
+    mutable rwlock topics_lock_;
+    std::unordered_map<std::string, std::vector<std::vector<uint32_t>>> topics_;
+    // topics of each subscribed service, for unsubscribe_all
+    std::unordered_map<uint32_t, std::vector<std::string>> subscriptions_;
     logger* logger_;
     server* server_;
 };
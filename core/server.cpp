@@ -3,7 +3,6 @@
 
 server::server()
     : state_(state::unknown)
-    , now_(0)
     , workers_()
     , logger_()
     , router_(workers_, &logger_)
@@ -16,7 +15,7 @@ server::~server()
     wait();
 }
 
-void server::init(uint8_t worker_num, const std::string& logpath)
+void server::init(uint8_t worker_num, const std::string& logpath, const worker_config& wcfg)
 {
     worker_num = (worker_num <= 0) ? 1 : worker_num;
 
@@ -24,85 +23,128 @@ void server::init(uint8_t worker_num, const std::string& logpath)
 
     router_.set_server(this);
 
+    // never reallocated, other threads read worker slots while workers are added
+    workers_.reserve(MAX_WORKER_NUM);
+    wcfg_ = wcfg;
+
     CONSOLE_INFO(get_logger(), "INIT with %ud workers.", worker_num);
 
     for (uint8_t idx = 0; idx < worker_num; idx++)
     {
-        workers_.emplace_back(std::make_unique<worker>(this, &router_, idx + 1));
+        workers_.emplace_back(std::make_unique<worker>(this, &router_, idx + 1, 0, wcfg));
+    }
+
+    for (const auto& pool : wcfg.pools)
+    {
+        if (pool.name.empty() || router_.pool_index(pool.name) >= 0)
+        {
+            CONSOLE_ERROR(get_logger(), "worker pool '%s' ignored: name empty or duplicated.", pool.name.data());
+            continue;
+        }
+
+        uint8_t thread = (pool.thread == 0) ? 1 : pool.thread;
+        if (workers_.size() + thread > MAX_WORKER_NUM)
+        {
+            CONSOLE_ERROR(get_logger(), "worker pool '%s' ignored: too many workers.", pool.name.data());
+            continue;
+        }
+
+        auto poolidx = static_cast<uint8_t>(router_.pools_.size());
+        router_.pools_.emplace_back(pool.name);
+        CONSOLE_INFO(get_logger(), "INIT worker pool '%s' with %u workers.", pool.name.data(), thread);
+        for (uint8_t idx = 0; idx < thread; idx++)
+        {
+            workers_.emplace_back(std::make_unique<worker>(this, &router_, static_cast<uint8_t>(workers_.size() + 1), poolidx, wcfg));
+        }
     }
 
     for (auto& worker : workers_)
     {
         worker->init();
     }
+    router_.worker_num_.store(static_cast<uint32_t>(workers_.size()), std::memory_order_release);
 
     state_.store(state::init, std::memory_order_release);
 }
 
-void server::run()
+worker* server::add_worker(uint8_t pool)
 {
-    if (0 == workers_.size())
+    std::lock_guard<std::mutex> lock(resize_mutex_);
+    if (state_.load() != state::ready)
     {
-        printf("should run server::init first!\r\n");
-        return;
+        CONSOLE_ERROR(get_logger(), "add worker failed: server is not running.");
+        return nullptr;
     }
 
-    state_.store(state::ready, std::memory_order_release);
+    // the slot of a retired worker whose thread ended is reused before a new id is taken
+    auto n = router_.worker_num();
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        auto& w = workers_[i];
+        if (w->pool() == pool && w->restart())
+        {
+            ++restarts_;
+            if (state_.load() != state::ready)
+            {
+                w->stop();
+            }
+            CONSOLE_INFO(get_logger(), "WORKER-%u restarted in pool %u.", w->id(), pool);
+            return w.get();
+        }
+    }
 
-    for (auto& worker : workers_)
+    if (n >= MAX_WORKER_NUM)
     {
-        worker->start();
+        CONSOLE_ERROR(get_logger(), "add worker failed: too many workers.");
+        return nullptr;
     }
 
-    int64_t previous_tick = time::now();
-    int64_t sleep_duration = 0;
-    while (true)
+    auto w = std::make_unique<worker>(this, &router_, static_cast<uint8_t>(n + 1), pool, wcfg_);
+    w->init();
+    workers_.emplace_back(std::move(w));
+    router_.worker_num_.store(n + 1);
+
+    // pairs with stop(): either it sees the new worker or we see it stopping
+    if (state_.load() != state::ready)
     {
-        now_ = time::now();
-        auto diff = now_ - previous_tick;
-        diff = (diff < 0) ? 0 : diff;
-        previous_tick = now_;
+        workers_[n]->stop();
+    }
 
-        size_t stoped_worker_num = 0;
+    CONSOLE_INFO(get_logger(), "WORKER-%u added to pool %u.", n + 1, pool);
+    return workers_[n].get();
+}
 
-        for (const auto& worker : workers_)
-        {
-            if (worker->stoped())
-            {
-                stoped_worker_num++;
-            }
-            worker->update();
-        }
+void server::run()
+{
+    if (0 == router_.worker_num())
+    {
+        printf("should run server::init first!\r\n");
+        return;
+    }
 
-        if (stoped_worker_num == workers_.size())
-        {
-            break;
-        }
+    state_.store(state::ready, std::memory_order_release);
 
-        if (diff <= UPDATE_INTERVAL + sleep_duration)
-        {
-            sleep_duration = UPDATE_INTERVAL + sleep_duration - diff;
-            thread_sleep(sleep_duration);
-        }
-        else
-        {
-            sleep_duration = 0;
-        }
+    for (uint32_t i = 0, n = router_.worker_num(); i < n; ++i)
+    {
+        workers_[i]->start();
     }
+
+    // workers sleep until their next message or timer, the main thread only waits for them to exit
     wait();
 }
 
 void server::stop()
 {
-    auto s = state_.exchange(state::stopping, std::memory_order_acquire);
+    auto s = state_.exchange(state::stopping);
     if (s > state::ready)
     {
         return;
     }
 
-    for (const auto& worker : workers_)
+    // seq_cst pairs with add_worker
+    for (uint32_t i = 0, n = router_.worker_num_.load(); i < n; ++i)
     {
-        worker->stop();
+        workers_[i]->stop();
     }
 }
 
@@ -118,9 +160,23 @@ router* server::get_router()
 
 void server::wait()
 {
-    for (auto iter = workers_.rbegin(); iter != workers_.rend(); ++iter)
+    // workers may be added or restarted while the first ones are joined, both only happen
+    // under resize_mutex_ while the server is ready, a pass that saw every thread is the last
+    uint32_t restarts = 0;
+    for (auto n = router_.worker_num();;)
     {
-        (*iter)->wait();
+        for (auto i = n; i > 0; --i)
+        {
+            workers_[i - 1]->wait();
+        }
+
+        std::lock_guard<std::mutex> lock(resize_mutex_);
+        if (n == router_.worker_num() && restarts == restarts_)
+        {
+            break;
+        }
+        n = router_.worker_num();
+        restarts = restarts_;
     }
     CONSOLE_INFO(get_logger(), "STOP");
     logger_.wait();
@@ -134,15 +190,15 @@ state server::get_state()
 
 int64_t server::now()
 {
-    return now_;
+    return time::now();
 }
 
 uint32_t server::service_count()
 {
     uint32_t count = 0;
-    for (const auto& worker : workers_)
+    for (uint32_t i = 0, n = router_.worker_num(); i < n; ++i)
     {
-        count += worker->count_.load(std::memory_order_acquire);
+        count += workers_[i]->count_.load(std::memory_order_acquire);
     }
     return count;
 }
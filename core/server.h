@@ -14,12 +14,16 @@ public:
 
     server(server&&) = delete;
 
-    void init(uint8_t worker_num, const std::string& logpath);
+    void init(uint8_t worker_num, const std::string& logpath, const worker_config& wcfg = worker_config{});
 
     void run();
 
     void stop();
 
+    // start one more worker in the pool while running, restarting the thread of an
+    // ended retired worker of the pool first, nullptr on failure
+    worker* add_worker(uint8_t pool);
+
     logger* get_logger();
 
     router* get_router();
@@ -35,8 +39,11 @@ private:
 
 private:
     std::atomic<state> state_;
-    int64_t now_;
     std::vector<std::unique_ptr<worker>> workers_;
+    std::mutex resize_mutex_;
+    // worker threads restarted by add_worker, written under resize_mutex_
+    uint32_t restarts_ = 0;
+    worker_config wcfg_;
     logger logger_;
     router router_;
 };
@@ -17,10 +17,33 @@ struct service_config
     std::string config;
 };
 
+struct pool_config
+{
+    std::string name;
+    int32_t thread = 0;
+};
+
 struct server_config
 {
     int32_t sid = 0;
     uint8_t thread = 0;
+    // microseconds an idle worker keeps polling without blocking
+    int32_t spin = 0;
+    // per service budget of one worker drain round, in messages and microseconds
+    int32_t quantum = 0;
+    int32_t quantum_time = 0;
+    // sample one of every n cross-worker messages for co-location, 0 disables it
+    int32_t traffic_sample = 0;
+    // milliseconds between automatic colocate rounds over the top pairs, 0 leaves it to core.colocate
+    int32_t colocate_interval = 0;
+    int32_t colocate_top = 0;
+    // cpu affinity: worker i runs on cpus[i] or on every cpu of numa node numa[i], -1 means not pinned
+    int32_t main_cpu = -1;
+    int32_t logger_cpu = -1;
+    std::vector<int32_t> cpus;
+    std::vector<int32_t> numa;
+    // named worker pools, services choose one with "pool" in their config
+    std::vector<pool_config> pools;
     std::string loglevel;
     std::string name;
     std::string outer_host;
@@ -138,6 +161,40 @@ public:
             scfg.outer_host = rapidjson::get_value<std::string>(&c, "outer_host", "*");
             scfg.inner_host = rapidjson::get_value<std::string>(&c, "inner_host", "127.0.0.1");
             scfg.thread = rapidjson::get_value<int32_t>(&c, "thread", std::thread::hardware_concurrency());
+            scfg.spin = rapidjson::get_value<int32_t>(&c, "spin", 0);
+            scfg.quantum = rapidjson::get_value<int32_t>(&c, "quantum", 0);
+            scfg.quantum_time = rapidjson::get_value<int32_t>(&c, "quantum_time", 0);
+            scfg.traffic_sample = rapidjson::get_value<int32_t>(&c, "traffic_sample", 0);
+            scfg.colocate_interval = rapidjson::get_value<int32_t>(&c, "colocate_interval", 0);
+            scfg.colocate_top = rapidjson::get_value<int32_t>(&c, "colocate_top", 16);
+            scfg.main_cpu = rapidjson::get_value<int32_t>(&c, "main_cpu", -1);
+            scfg.logger_cpu = rapidjson::get_value<int32_t>(&c, "logger_cpu", -1);
+            scfg.cpus = rapidjson::get_value<std::vector<int32_t>>(&c, "cpus");
+            scfg.numa = rapidjson::get_value<std::vector<int32_t>>(&c, "numa");
+
+            auto pools = rapidjson::get_value<rapidjson::Value*>(&c, "pools", nullptr);
+            if (nullptr != pools)
+            {
+                if (!pools->IsArray())
+                {
+                    printf("Server config format error: pools must be array.\n");
+                    return false;
+                }
+
+                for (auto& p : pools->GetArray())
+                {
+                    pool_config pc;
+                    pc.name = rapidjson::get_value<std::string>(&p, "name");
+                    pc.thread = rapidjson::get_value<int32_t>(&p, "thread", 1);
+                    if (pc.name.empty())
+                    {
+                        printf("Server config format error: pool must has name.\n");
+                        return false;
+                    }
+                    scfg.pools.emplace_back(pc);
+                }
+            }
+
             scfg.startup = rapidjson::get_value<std::string>(&c, "startup");
             scfg.log = rapidjson::get_value<std::string>(&c, "log");
             scfg.loglevel = rapidjson::get_value<std::string>(&c, "loglevel", "DEBUG");
@@ -92,20 +92,69 @@ public:
     {
         dispatch(m.get());
 
-        // redirect message
-        if (m->receiver() != id() && m->receiver() != 0)
+        if constexpr (std::is_rvalue_reference_v<decltype(m)>)
         {
-            if (m->broadcast())
+            // the cut dispatch still reads the message, it is redirected when resumed
+            if (suspended())
             {
-                CONSOLE_ERROR(router_->get_logger(), "can not redirect broadcast message.");
+                suspended_message_ = std::forward<Message>(m);
                 return;
             }
+        }
 
-            if constexpr (std::is_rvalue_reference_v<decltype(m)>)
-            {
-                router_->send_message(std::forward<message_ptr_t>(m));
-            }
+        redirect(std::forward<Message>(m));
+    }
+
+    // continue a dispatch cut by its cpu budget, called by worker once per drain round
+    void resume_dispatch()
+    {
+        resume();
+        if (suspended())
+        {
+            return;
+        }
+
+        if (nullptr != suspended_message_)
+        {
+            auto m = std::move(suspended_message_);
+            redirect(std::move(m));
         }
+
+        // fired while the dispatch was cut, in their order
+        auto timers = std::move(suspended_timers_);
+        suspended_timers_.clear();
+        for (auto& t : timers)
+        {
+            on_timer(t.first, t.second);
+        }
+    }
+
+    // a timer of a suspended service waits for the cut dispatch like its messages do
+    void handle_timer(uint32_t timerid, bool remove)
+    {
+        if (suspended())
+        {
+            suspended_timers_.emplace_back(timerid, remove);
+            return;
+        }
+        on_timer(timerid, remove);
+    }
+
+    // bound the mailbox, limit 0 removes the bound
+    void set_mailbox(size_t limit, mailbox_policy policy)
+    {
+        if (limit == 0)
+        {
+            router_->remove_mailbox(id_);
+            mailbox_ = nullptr;
+            return;
+        }
+        mailbox_ = router_->set_mailbox(id_, limit, policy);
+    }
+
+    const mailbox_ptr_t& get_mailbox() const
+    {
+        return mailbox_;
     }
 
     void quit()
@@ -120,6 +169,27 @@ public:
 
     virtual void on_timer(uint32_t, bool) {};
 
+    // true while a dispatch cut by its cpu budget waits to be resumed,
+    // the worker holds back the service's messages until then
+    virtual bool suspended() const
+    {
+        return false;
+    }
+
+    virtual void resume() {}
+
+    // false once the service holds state tied to its worker, e.g. handles on the worker loop
+    virtual bool migratable() const
+    {
+        return true;
+    }
+
+    // bytes the service holds, used by load-aware placement
+    virtual size_t memory_use()
+    {
+        return 0;
+    }
+
     virtual void start()
     {
         start_ = true;
@@ -156,4 +226,35 @@ protected:
     router* router_ = nullptr;
     worker* worker_ = nullptr;
     std::string name_;
+
+private:
+    template<typename Message>
+    void redirect(Message&& m)
+    {
+        if (m->receiver() != id() && m->receiver() != 0)
+        {
+            if (m->broadcast())
+            {
+                CONSOLE_ERROR(router_->get_logger(), "can not redirect broadcast message.");
+                return;
+            }
+
+            if constexpr (std::is_rvalue_reference_v<decltype(m)>)
+            {
+                router_->send_message(std::forward<message_ptr_t>(m));
+            }
+        }
+    }
+
+private:
+    // fairness accounting of the current drain round, maintained by worker
+    bool round_exceeded_ = false;
+    uint32_t round_count_ = 0;
+    uint64_t round_ = 0;
+    int64_t round_time_ = 0;
+    mailbox_ptr_t mailbox_;
+    // message of the suspended dispatch
+    message_ptr_t suspended_message_;
+    // timers that fired while the dispatch was suspended
+    std::vector<std::pair<uint32_t, bool>> suspended_timers_;
 };
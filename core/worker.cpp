@@ -4,63 +4,155 @@
 #include "common/hash.hpp"
 #include "common/message.hpp"
 #include "common/logger.hpp"
+#include "common/affinity.hpp"
 #include "server.h"
 #include "service.hpp"
 
-worker::worker(server* server, router* router, uint8_t id)
-    : server_(server)
+worker::worker(server* server, router* router, uint8_t id, uint8_t pool, const worker_config& cfg)
+    : cfg_(cfg)
+    , server_(server)
     , router_(router)
     , workerid_(id)
+    , pool_(pool)
 {
+    // ready before anything is posted, the thread only starts running it in init()
+    uv_loop_init(&loop_);
+    loop_.data = this;
+    open_loop();
 }
 
 worker::~worker()
 {
+    // the thread closed everything when it ran, otherwise our handles are still open
+    close_loop();
+
+    if (auto err = uv_loop_close(&loop_); err != 0)
+    {
+        CONSOLE_ERROR(router_->get_logger(), "WORKER-%u close loop failed: %s", workerid_, uv_strerror(err));
+    }
+}
+
+void worker::close_loop()
+{
+    // services first, lluv handles they opened on this loop are closed by their __gc
+    for (auto& slot : slots_)
+    {
+        slot.service.reset();
+    }
+    guests_.clear();
+
+    // then our own handles and whatever a script left open
+    uv_walk(&loop_, [](uv_handle_t* handle, void*) {
+        if (!uv_is_closing(handle))
+        {
+            uv_close(handle, nullptr);
+        }
+    }, nullptr);
+
+    // until every close callback ran
+    uv_run(&loop_, UV_RUN_DEFAULT);
+}
+
+void worker::open_loop()
+{
+    // on a fresh loop, or on the one close_loop left when a retired worker restarts
+    uv_async_init(&loop_, &async_, [](uv_async_t*) {
+        // the check handle does the work after this poll
+    });
+
+    uv_timer_init(&loop_, &timer_handle_);
+    timer_handle_.data = this;
+
+    if (cfg_.colocate_interval > 0)
+    {
+        uv_timer_init(&loop_, &colocate_handle_);
+        colocate_handle_.data = this;
+        auto interval = static_cast<uint64_t>(cfg_.colocate_interval);
+        uv_timer_start(&colocate_handle_, [](uv_timer_t* handle) {
+            auto w = static_cast<worker*>(handle->data);
+            w->router_->colocate_round(w->cfg_.colocate_interval, w->cfg_.colocate_top);
+        }, interval, interval);
+    }
+
+    uv_idle_init(&loop_, &idle_);
+
+    uv_prepare_init(&loop_, &prepare_);
+    prepare_.data = this;
+    uv_prepare_start(&prepare_, [](uv_prepare_t* handle) {
+        auto w = static_cast<worker*>(handle->data);
+        // seq_cst pairs with signal(): either we see the signal here and poll
+        // without blocking, or the signaller sees sleeping_ and wakes the loop
+        w->sleeping_.store(true);
+        if (w->signals_.load() != 0)
+        {
+            w->schedule();
+        }
+    });
+
+    uv_check_init(&loop_, &check_);
+    check_.data = this;
+    uv_check_start(&check_, [](uv_check_t* handle) {
+        auto w = static_cast<worker*>(handle->data);
+        w->sleeping_.store(false, std::memory_order_release);
+        w->run_once();
+    });
 }
 
 void worker::init()
 {
-    timer_.set_now_func([this]() {
-        return server_->now();
+    timer_.set_now_func([]() {
+        return time::now();
     });
 
     timer_.set_on_timer([this](timer_id_t timerid, uint32_t serviceid, bool remove) {
         auto s = find_service(serviceid);
         if (s != nullptr)
         {
-            s->on_timer(timerid, remove);
+            s->handle_timer(timerid, remove);
         }
         else
         {
-            timer_.remove(timerid);
+            timer_.remove(timerid, serviceid);
         }
     });
 
     thread_ = std::thread([this]() {
-        state_.store(state::ready, std::memory_order_release);
-        CONSOLE_INFO(router_->get_logger(), "WORKER-%u START", workerid_);
-
-        while (true)
+        // pin before anything is allocated, so first touch places memory on the local numa node
+        if (size_t idx = workerid_ - 1; idx < cfg_.cpus.size() && !cfg_.cpus[idx].empty())
         {
-            auto s = state_.load(std::memory_order_acquire);
-            if (s == state::exited)
+            if (!affinity::bind_current(cfg_.cpus[idx]))
             {
-                break;
+                CONSOLE_WARN(router_->get_logger(), "WORKER-%u bind cpu failed", workerid_);
             }
 
-            if (!queue_.empty())
+            if (idx < cfg_.nodes.size() && !affinity::prefer_node(cfg_.nodes[idx]))
+            {
+                CONSOLE_WARN(router_->get_logger(), "WORKER-%u prefer numa node %d failed", workerid_, cfg_.nodes[idx]);
+            }
+        }
+        else if (cfg_.restore_cpus)
+        {
+            // the thread that spawned us may be pinned, e.g. a worker adding workers at runtime
+            if (!affinity::unbind_current())
             {
-                std::unique_lock<std::mutex> lock(mutex_);
-                auto task = queue_.front();
-                queue_.pop_front();
-                lock.unlock();
-                task();
+                CONSOLE_WARN(router_->get_logger(), "WORKER-%u restore process cpus failed", workerid_);
             }
+        }
+
+        current_ = this;
 
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
-            // std::this_thread::yield();
+        state_.store(state::ready, std::memory_order_release);
+        CONSOLE_INFO(router_->get_logger(), "WORKER-%u START", workerid_);
+
+        // whatever was posted before the loop runs
+        run_once();
+        if (state_.load(std::memory_order_acquire) != state::exited)
+        {
+            uv_run(&loop_, UV_RUN_DEFAULT);
         }
 
+        close_loop();
+
         CONSOLE_INFO(router_->get_logger(), "WORKER-%u STOP", workerid_);
     });
 
@@ -71,32 +163,183 @@ void worker::init()
     }
 }
 
+void worker::post(command_t&& cmd)
+{
+    // a command must not overtake the messages the posting worker batched for us
+    if (auto cw = current_; nullptr != cw && cw != this)
+    {
+        cw->flush_outbound(this);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.emplace_back(std::move(cmd));
+        has_task_.store(true, std::memory_order_release);
+    }
+
+    // the worker's own thread checks has_task_ before the loop polls again,
+    // commands are rare, so other threads wake the loop unconditionally
+    if (current_ != this)
+    {
+        uv_async_send(&async_);
+    }
+}
+
+void worker::signal(uint32_t s)
+{
+    // somebody else already raised it and woke the worker
+    if ((signals_.fetch_or(s) & s) == s)
+    {
+        return;
+    }
+
+    // a busy loop sees the signal before it polls again, only a sleeping one needs the
+    // wakeup, which costs a write to the loop's wakeup fd
+    if (current_ != this && sleeping_.load())
+    {
+        uv_async_send(&async_);
+    }
+}
+
+void worker::run_once()
+{
+    auto busy_begin = time::microsecond();
+
+    if (has_task_.load(std::memory_order_acquire))
+    {
+        run_commands();
+    }
+
+    // a producer that linked its node after the last drain raised no signal, see drain
+    auto signals = signals_.exchange(0, std::memory_order_acq_rel);
+    if ((signals & signal_drain) || mq_.ready() || pmq_.ready())
+    {
+        drain();
+    }
+
+    // cheap when nothing is due, there is no central ticker any more
+    timer_.update();
+
+    // sent by commands, timers or the previous local round
+    if (!local_.empty())
+    {
+        drain_local();
+    }
+
+    if (!blocked_.empty())
+    {
+        release_blocked();
+    }
+
+    flush_outbound();
+
+    if (state_.load(std::memory_order_acquire) == state::exited)
+    {
+        uv_stop(&loop_);
+        return;
+    }
+
+    schedule();
+
+    account(time::microsecond() - busy_begin);
+}
+
+void worker::schedule()
+{
+    // a producer counted in size() but not linked yet saw a non-empty queue and raised
+    // no signal_drain, poll until run_once sees its node instead of draining in a loop
+    bool pending = !local_.empty()
+        || signals_.load(std::memory_order_acquire) != 0
+        || has_task_.load(std::memory_order_acquire)
+        || mq_.size() != 0
+        || pmq_.size() != 0;
+
+    auto now = time::microsecond();
+    if (pending)
+    {
+        idle_until_ = now + cfg_.spin;
+    }
+
+    if (pending || now < idle_until_)
+    {
+        uv_idle_start(&idle_, [](uv_idle_t*) {
+            // the check handle does the work after this poll
+        });
+    }
+    else
+    {
+        uv_idle_stop(&idle_);
+    }
+
+    // sleep until the next message or the next timer deadline,
+    // held messages retry every millisecond
+    auto expire = timer_.next_expire();
+    if (!blocked_.empty() && (expire < 0 || expire > 1))
+    {
+        expire = 1;
+    }
+
+    if (expire >= 0)
+    {
+        // the cached loop time may be a whole busy pass old
+        uv_update_time(&loop_);
+        uv_timer_start(&timer_handle_, [](uv_timer_t* handle) {
+            static_cast<worker*>(handle->data)->run_once();
+        }, static_cast<uint64_t>(expire), 0);
+    }
+    else
+    {
+        uv_timer_stop(&timer_handle_);
+    }
+}
+
+void worker::run_commands()
+{
+    {
+        // take every queued command in one go
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.swap(swapqueue_);
+        has_task_.store(false, std::memory_order_release);
+    }
+
+    for (auto& cmd : swapqueue_)
+    {
+        std::visit([this](auto& v) {
+            handle_command(v);
+        }, cmd);
+    }
+    swapqueue_.clear();
+}
+
 void worker::stop()
 {
-    std::lock_guard<std::mutex> lock(mutex_);
-    queue_.emplace_back([this] {
-        auto s = state_.load(std::memory_order_acquire);
-        if (s == state::stopping || s == state::exited)
-        {
-            return;
-        }
+    post(stop_command{});
+}
 
-        if (services_.empty())
-        {
-            state_.store(state::exited, std::memory_order_release);
-            return;
-        }
+void worker::handle_command(stop_command&)
+{
+    auto s = state_.load(std::memory_order_acquire);
+    if (s == state::stopping || s == state::exited)
+    {
+        return;
+    }
 
-        state_.store(state::stopping, std::memory_order_release);
-        for (auto& it : services_)
-        {
-            it.second->exit();
-        }
+    if (count() == 0)
+    {
+        state_.store(state::exited, std::memory_order_release);
+        return;
+    }
+
+    state_.store(state::stopping, std::memory_order_release);
+    for_each_service([](service* s) {
+        s->exit();
     });
 }
 
 void worker::wait()
 {
+    // the server joins while add_worker may restart the thread
+    std::lock_guard<std::mutex> lock(thread_mutex_);
     if (thread_.joinable())
     {
         thread_.join();
@@ -108,215 +351,1003 @@ bool worker::stoped() const
     return state_.load(std::memory_order_acquire) == state::exited;
 }
 
-uint32_t worker::uuid()
+uint32_t worker::alloc_id()
+{
+    uint32_t idx = 0;
+    if (!free_slots_.empty())
+    {
+        idx = free_slots_.front();
+        free_slots_.pop_front();
+    }
+    else if (slots_.size() <= SERVICE_SLOT_MASK)
+    {
+        idx = static_cast<uint32_t>(slots_.size());
+        slots_.emplace_back();
+    }
+    else
+    {
+        return 0;
+    }
+    return (static_cast<uint32_t>(id()) << WORKER_ID_SHIFT) | (slots_[idx].generation << SERVICE_SLOT_BITS) | idx;
+}
+
+void worker::free_id(uint32_t serviceid)
 {
-    auto res = uuid_++;
-    res %= max_uuid;
-    ++res;
-    res |= id() << WORKER_ID_SHIFT;
-    return res;
+    if (auto slot = slot_of(serviceid); nullptr != slot)
+    {
+        slot->service = nullptr;
+        slot->forward = 0;
+        slot->generation = (slot->generation + 1) & SERVICE_GENERATION_MASK;
+        free_slots_.emplace_back(serviceid & SERVICE_SLOT_MASK);
+    }
 }
 
 void worker::add_service(std::string service_type, std::string config, bool unique, uint32_t creatorid, int32_t sessionid)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
-    queue_.emplace_back([this, service_type = std::move(service_type), config = std::move(config), unique, creatorid, sessionid](){
-        do
-        {
-            if (state_.load(std::memory_order_acquire) != state::ready)
-            {
-                break;
-            }
+    pending_.fetch_add(1, std::memory_order_release);
+    post(add_service_command{ std::move(service_type), std::move(config), unique, creatorid, sessionid });
+}
 
-            size_t counter = 0;
-            uint32_t serviceid = 0;
-            do
-            {
-                if (counter >= worker::max_uuid)
-                {
-                    CONSOLE_ERROR(router_->get_logger(), "new service failed: can not get more service id. worker[%d] service num[%u].", id(), services_.size());
-                    break;
-                }
-                serviceid = uuid();
-                ++counter;
-            } while (services_.find(serviceid) != services_.end());
+void worker::handle_command(add_service_command& cmd)
+{
+    pending_.fetch_sub(1, std::memory_order_release);
 
-            auto s = router_->make_service(service_type);
-            if (!s)
-            {
-                CONSOLE_ERROR(router_->get_logger(), "new service failed:service type[%s] was not registered", service_type.data());
-                break;
-            }
+    do
+    {
+        if (state_.load(std::memory_order_acquire) != state::ready)
+        {
+            break;
+        }
 
-            s->set_id(serviceid);
-            s->set_logger(router_->get_logger());
-            s->set_unique(unique);
-            s->set_server_context(server_, router_, this);
+        uint32_t serviceid = alloc_id();
+        if (0 == serviceid)
+        {
+            CONSOLE_ERROR(router_->get_logger(), "new service failed: can not get more service id. worker[%d] service num[%u].", id(), count());
+            break;
+        }
 
-            if (!s->init(config))
-            {
-                break;
-            }
+        auto s = router_->make_service(cmd.service_type);
+        if (!s)
+        {
+            free_id(serviceid);
+            CONSOLE_ERROR(router_->get_logger(), "new service failed:service type[%s] was not registered", cmd.service_type.data());
+            break;
+        }
 
-            s->ok(true);
+        s->set_id(serviceid);
+        s->set_logger(router_->get_logger());
+        s->set_unique(cmd.unique);
+        s->set_server_context(server_, router_, this);
 
-            auto res = services_.emplace(serviceid, std::move(s));
-            if (!res.second)
-            {
-                break;
-            }
+        if (!s->init(cmd.config))
+        {
+            router_->remove_mailbox(serviceid);
+            router_->unsubscribe_all(serviceid);
+            free_id(serviceid);
+            break;
+        }
 
-            count_.fetch_add(1, std::memory_order_release);
+        s->ok(true);
 
-            if (server_->get_state() != state::init)
-            {
-                res.first->second->start();
-            }
+        auto ser = s.get();
+        slots_[serviceid & SERVICE_SLOT_MASK].service = std::move(s);
 
-            if (0 != sessionid)
-            {
-                router_->response(creatorid, std::string_view{}, std::to_string(serviceid), sessionid);
-            }
-            return;
-        } while (false);
+        count_.fetch_add(1, std::memory_order_release);
 
-        shared(services_.empty());
+        if (server_->get_state() != state::init)
+        {
+            ser->start();
+        }
 
-        if (0 != sessionid)
+        if (0 != cmd.sessionid)
         {
-            router_->response(creatorid, std::string_view{}, "0", sessionid);
+            router_->response(cmd.creatorid, std::string_view{}, std::to_string(serviceid), cmd.sessionid);
         }
-    });
+        return;
+    } while (false);
+
+    shared(count() == 0);
+
+    if (0 != cmd.sessionid)
+    {
+        router_->response(cmd.creatorid, std::string_view{}, "0", cmd.sessionid);
+    }
 }
 
 void worker::remove_service(uint32_t serviceid, uint32_t sender, uint32_t sessionid)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
-    queue_.emplace_back([this, serviceid, sender, sessionid] {
-        if (auto s = find_service(serviceid); nullptr != s)
-        {
-            count_.fetch_sub(1, std::memory_order_release);
+    post(remove_service_command{ serviceid, sender, sessionid });
+}
 
-            s->destroy();
-            auto content = format(R"({"name":"%s","serviceid":%X,"errmsg":"service destroy"})", s->name().data(), s->id());
-            router_->response(sender, "service destroy", content, sessionid);
-            services_.erase(serviceid);
-            if (services_.empty()) shared(true);
+void worker::handle_command(remove_service_command& cmd)
+{
+    // a sender's earlier messages may still be queued, they reach the service first
+    removals_.emplace_back(std::move(cmd));
+    signal(signal_drain);
+}
 
-            string_view_t header{ "exit" };
-            auto buf = message::create_buffer();
-            buf->write_back(content.data(), content.size());
-            router_->broadcast(serviceid, buf, header, PTYPE_SYSTEM);
-        }
-        else
-        {
-            router_->response(sender, "worker::remove_service ", format("service [%X] not found", serviceid), sessionid, PTYPE_ERROR);
-        }
+void worker::run_removals()
+{
+    swapremovals_.clear();
+    swapremovals_.swap(removals_);
+
+    // whatever was pushed before the removals were posted is linked by now
+    drain_priority();
+    swapmq_.clear();
+    mq_.consume([this](message_ptr_t&& msg) {
+        swapmq_.emplace_back(std::move(msg));
+    });
+
+    service* ser = nullptr;
+    for (auto& msg : swapmq_)
+    {
+        handle_one(ser, std::move(msg));
+    }
+    drain_local();
 
-        if (services_.size() == 0 && state_.load(std::memory_order_acquire) == state::stopping)
+    for (auto& cmd : swapremovals_)
+    {
+        // messages the quantum deferred were sent before the removal too
+        flush_deferred(cmd.serviceid);
+
+        // a cut dispatch finishes first, the removal waits for a later round
+        if (auto s = find_service(cmd.serviceid); nullptr != s && s->suspended())
         {
-            state_.store(state::exited, std::memory_order_release);
+            removals_.emplace_back(std::move(cmd));
+            continue;
         }
-    });
+        remove_now(cmd);
+    }
+    swapremovals_.clear();
 }
 
-void worker::send(message_ptr_t&& msg)
+void worker::flush_deferred(uint32_t serviceid)
 {
-    if (mq_.push_back(std::move(msg)) == 1)
+    if (deferred_.empty())
     {
-        std::lock_guard<std::mutex> lock(mutex_);
-        queue_.emplace_back([this] {
-            size_t count = 0;
-            if (mq_.size() != 0)
-            {
-                service* ser = nullptr;
-                swapmq_.clear();
-                mq_.swap(swapmq_);
-                count = swapmq_.size();
-                for (auto& msg : swapmq_)
-                {
-                    handle_one(ser, std::move(msg));
-                }
-            }
+        return;
+    }
 
-            auto begin_time = server_->now();
-            if (begin_time != 0)
-            {
-                auto difftime = server_->now() - begin_time;
-                cpu_time_ += difftime;
-                if (difftime > 1000)
-                {
-                    CONSOLE_WARN(router_->get_logger(), "worker handle cost %" PRId64 "ms queue size %zu", difftime, count);
-                }
-            }
-        });
+    queue_t::container_type flushed;
+    auto last = std::stable_partition(deferred_.begin(), deferred_.end(), [serviceid](const message_ptr_t& msg) {
+        return msg->receiver() != serviceid;
+    });
+    std::move(last, deferred_.end(), std::back_inserter(flushed));
+    deferred_.erase(last, deferred_.end());
+
+    // past the quantum, a suspended service defers them again
+    service* ser = nullptr;
+    for (auto& msg : flushed)
+    {
+        handle_one(ser, std::move(msg), true);
     }
 }
 
-uint8_t worker::id() const
+void worker::remove_now(remove_service_command& cmd)
 {
-    return workerid_;
-}
+    if (auto s = find_service(cmd.serviceid); nullptr != s)
+    {
+        count_.fetch_sub(1, std::memory_order_release);
 
-service* worker::find_service(uint32_t serviceid) const
-{
-    auto iter = services_.find(serviceid);
-    if (services_.end() != iter)
+        s->destroy();
+        auto content = format(R"({"name":"%s","serviceid":%X,"errmsg":"service destroy"})", s->name().data(), s->id());
+        router_->response(cmd.sender, "service destroy", content, cmd.sessionid);
+        router_->remove_mailbox(cmd.serviceid);
+        if (auto origin = router_->worker_id(cmd.serviceid); origin != id())
+        {
+            router_->remove_host(cmd.serviceid);
+            guests_.erase(cmd.serviceid);
+            router_->get_worker(origin)->post(forward_service_command{ cmd.serviceid, 0 });
+        }
+        else
+        {
+            free_id(cmd.serviceid);
+        }
+        if (count() == 0) shared(true);
+
+        // only the services that asked to hear about exits
+        router_->unsubscribe_all(cmd.serviceid);
+        auto buf = message::create_buffer();
+        buf->write_back(content.data(), content.size());
+        router_->publish(cmd.serviceid, std::string{ HEADER_EXIT }, buf, PTYPE_SYSTEM);
+    }
+    else if (auto w = forward_worker(cmd.serviceid); nullptr != w)
     {
-        return iter->second.get();
+        w->remove_service(cmd.serviceid, cmd.sender, cmd.sessionid);
     }
-    return nullptr;
+    else
+    {
+        router_->response(cmd.sender, "worker::remove_service ", format("service [%X] not found", cmd.serviceid), cmd.sessionid, PTYPE_ERROR);
+    }
+
+    if (count() == 0 && state_.load(std::memory_order_acquire) == state::stopping)
+    {
+        state_.store(state::exited, std::memory_order_release);
+    }
+
+    finish_retire();
 }
 
-void worker::shared(bool v)
+void worker::migrate_service(uint32_t serviceid, uint8_t target)
 {
-    shared_ = v;
+    post(migrate_service_command{ serviceid, target });
 }
 
-bool worker::shared() const
+void worker::handle_command(migrate_service_command& cmd)
 {
-    return shared_.load();
+    move_service(cmd.serviceid, cmd.target);
 }
 
-void worker::start()
+bool worker::move_service(uint32_t serviceid, uint8_t targetid)
 {
-    std::lock_guard<std::mutex> lock(mutex_);
-    queue_.emplace_back([this] {
-        for (auto& it : services_)
+    auto owner = find_owner(serviceid);
+    if (nullptr == owner)
+    {
+        if (auto w = forward_worker(serviceid); nullptr != w)
         {
-            it.second->start();
+            w->migrate_service(serviceid, targetid);
+            return false;
         }
-    });
-}
+        CONSOLE_WARN(router_->get_logger(), "migrate service [%X] failed: service not found.", serviceid);
+        return false;
+    }
 
-void worker::update()
-{
-    //update_state is true
-    if (update_state_.test_and_set(std::memory_order_acquire))
+    if (targetid == id())
     {
-        return;
+        return false;
     }
 
-    std::lock_guard<std::mutex> lock(mutex_);
-    queue_.emplace_back([this] {
-        timer_.update();
-
-        update_state_.clear(std::memory_order_release);
-    });
-}
+    auto target = router_->get_worker(targetid);
+    if (state_.load(std::memory_order_acquire) != state::ready || !shared() || !target->shared())
+    {
+        CONSOLE_WARN(router_->get_logger(), "migrate service [%X] to worker %u failed: only services of ready shared workers can migrate.", serviceid, targetid);
+        return false;
+    }
 
-void worker::handle_one(service*& ser, message_ptr_t&& msg)
-{
-    if (msg->broadcast())
+    if (target->pool() != pool())
     {
-        for (auto& it : services_)
+        CONSOLE_WARN(router_->get_logger(), "migrate service [%X] to worker %u failed: services can not leave their pool.", serviceid, targetid);
+        return false;
+    }
+
+    if (!(*owner)->migratable())
+    {
+        CONSOLE_WARN(router_->get_logger(), "migrate service [%X] to worker %u failed: service is bound to this worker.", serviceid, targetid);
+        return false;
+    }
+
+    auto s = std::move(*owner);
+    count_.fetch_sub(1, std::memory_order_release);
+
+    // the adopt command must be queued before anything can be forwarded to the target,
+    // drain() runs pending commands after taking messages, so the service is there first
+    target->post(adopt_service_command{ std::move(s), timer_.extract(serviceid) });
+    // new messages go straight to the target, those already sent here are forwarded
+    router_->set_host(serviceid, targetid);
+
+    if (auto slot = slot_of(serviceid); nullptr != slot)
+    {
+        // the slot stays taken while the service lives elsewhere
+        slot->forward = targetid;
+    }
+    else
+    {
+        guests_.erase(serviceid);
+        forwards_[serviceid] = targetid;
+        router_->get_worker(router_->worker_id(serviceid))->post(forward_service_command{ serviceid, targetid });
+    }
+
+    CONSOLE_INFO(router_->get_logger(), "[WORKER %u] migrate service [%X] to worker %u", id(), serviceid, targetid);
+    return true;
+}
+
+void worker::handle_command(adopt_service_command& cmd)
+{
+    auto serviceid = cmd.service->id();
+    cmd.service->set_server_context(server_, router_, this);
+    timer_.adopt(cmd.timers);
+
+    service* ser = nullptr;
+    if (auto slot = slot_of(serviceid); nullptr != slot)
+    {
+        // coming home
+        if (slot->service)
+        {
+            CONSOLE_ERROR(router_->get_logger(), "adopt service [%X] failed: service id already exists.", serviceid);
+            return;
+        }
+        slot->forward = 0;
+        slot->service = std::move(cmd.service);
+        ser = slot->service.get();
+    }
+    else
+    {
+        forwards_.erase(serviceid);
+        auto res = guests_.emplace(serviceid, std::move(cmd.service));
+        if (!res.second)
+        {
+            CONSOLE_ERROR(router_->get_logger(), "adopt service [%X] failed: service id already exists.", serviceid);
+            return;
+        }
+        ser = res.first->second.get();
+    }
+    count_.fetch_add(1, std::memory_order_release);
+
+    if (ser->suspended() && std::find(suspended_.begin(), suspended_.end(), serviceid) == suspended_.end())
+    {
+        suspended_.emplace_back(serviceid);
+        signal(signal_drain);
+    }
+
+    if (state_.load(std::memory_order_acquire) == state::stopping)
+    {
+        ser->exit();
+    }
+}
+
+void worker::handle_command(forward_service_command& cmd)
+{
+    auto slot = slot_of(cmd.serviceid);
+    if (nullptr == slot)
+    {
+        return;
+    }
+
+    if (cmd.target == id())
+    {
+        slot->forward = 0;
+    }
+    else if (cmd.target != 0)
+    {
+        slot->forward = cmd.target;
+    }
+    else if (!slot->service)
+    {
+        // removed while it lived elsewhere, the id can be reused now
+        free_id(cmd.serviceid);
+        finish_retire();
+    }
+}
+
+void worker::send(message_ptr_t&& msg)
+{
+    // same worker: no atomics, no wakeup, handled later in this loop
+    if (current_ == this && !is_priority(msg->type()))
+    {
+        local_.emplace_back(std::move(msg));
+        return;
+    }
+
+    // another worker: batch it, the sender hands its batches over once per loop
+    if (auto cw = current_; nullptr != cw && !is_priority(msg->type()))
+    {
+        cw->outbound(this, std::move(msg));
+        return;
+    }
+
+    // a priority message must not overtake the messages the sending worker batched for us
+    if (auto cw = current_; nullptr != cw && cw != this)
+    {
+        cw->flush_outbound(this);
+    }
+
+    auto& q = is_priority(msg->type()) ? pmq_ : mq_;
+    if (q.push_back(std::move(msg)) == 1)
+    {
+        signal(signal_drain);
+    }
+}
+
+void worker::send_batch(std::vector<message_ptr_t>& batch)
+{
+    if (batch.empty())
+    {
+        return;
+    }
+
+    // a worker thread already batches per loop, going through send keeps the order
+    // with the messages it sent before
+    if (nullptr != current_ || is_priority(batch.front()->type()))
+    {
+        for (auto& msg : batch)
+        {
+            send(std::move(msg));
+        }
+        batch.clear();
+        return;
+    }
+
+    receive(batch);
+}
+
+void worker::drain()
+{
+    auto begin_time = time::millisecond();
+
+    ++round_;
+
+    resume_suspended();
+
+    drain_priority();
+
+    // requeued messages go first, so every service keeps its arrival order
+    swapmq_.clear();
+    swapmq_.swap(deferred_);
+    mq_.consume([this](message_ptr_t&& msg) {
+        swapmq_.emplace_back(std::move(msg));
+    });
+
+    // commands queued before these messages were sent, e.g. adopting a migrated service
+    if (has_task_.load(std::memory_order_acquire))
+    {
+        run_commands();
+    }
+
+    size_t count = swapmq_.size();
+    service* ser = nullptr;
+    for (auto& msg : swapmq_)
+    {
+        // a control message does not wait behind the rest of the batch
+        if (pmq_.size() != 0 && drain_priority() != 0)
+        {
+            ser = nullptr;
+        }
+        handle_one(ser, std::move(msg));
+    }
+
+    drain_local();
+
+    if (!removals_.empty())
+    {
+        run_removals();
+    }
+
+    if (mq_.ready() || pmq_.ready() || !deferred_.empty() || !suspended_.empty())
+    {
+        signal(signal_drain);
+    }
+
+    auto difftime = time::millisecond() - begin_time;
+    if (difftime > 1000)
+    {
+        CONSOLE_WARN(router_->get_logger(), "worker handle cost %" PRId64 "ms queue size %zu", difftime, count);
+    }
+}
+
+size_t worker::drain_priority()
+{
+    swappmq_.clear();
+    if (pmq_.consume([this](message_ptr_t&& msg) { swappmq_.emplace_back(std::move(msg)); }) == 0)
+    {
+        return 0;
+    }
+
+    if (has_task_.load(std::memory_order_acquire))
+    {
+        run_commands();
+    }
+
+    service* ser = nullptr;
+    for (auto& msg : swappmq_)
+    {
+        handle_one(ser, std::move(msg), true);
+    }
+    return swappmq_.size();
+}
+
+void worker::receive(queue_t::container_type& batch)
+{
+    auto n = batch.size();
+    if (n != 0 && mq_.push_batch(batch) == n)
+    {
+        signal(signal_drain);
+    }
+}
+
+void worker::outbound(worker* target, message_ptr_t&& msg)
+{
+    auto id = target->id();
+    if (id >= outbound_.size())
+    {
+        outbound_.resize(static_cast<size_t>(id) + 1);
+    }
+
+    auto& q = outbound_[id];
+    if (q.empty())
+    {
+        outbound_targets_.emplace_back(id);
+    }
+
+    q.emplace_back(std::move(msg));
+    if (q.size() >= max_outbound)
+    {
+        target->receive(q);
+    }
+}
+
+void worker::flush_outbound(worker* target)
+{
+    auto id = target->id();
+    if (id < outbound_.size() && !outbound_[id].empty())
+    {
+        target->receive(outbound_[id]);
+    }
+}
+
+void worker::flush_outbound()
+{
+    for (auto id : outbound_targets_)
+    {
+        if (auto& q = outbound_[id]; !q.empty())
+        {
+            router_->get_worker(id)->receive(q);
+        }
+    }
+    outbound_targets_.clear();
+}
+
+void worker::block(message_ptr_t&& msg, mailbox_ptr_t mb, worker* target)
+{
+    ++blocked_count_[msg->receiver()];
+    blocked_.emplace_back(blocked_message{ std::move(msg), std::move(mb), target, time::millisecond() + mailbox::block_timeout });
+}
+
+bool worker::blocked(uint32_t receiver) const
+{
+    return !blocked_count_.empty() && blocked_count_.find(receiver) != blocked_count_.end();
+}
+
+void worker::release_blocked()
+{
+    auto now = time::millisecond();
+    bool stopping = server_->get_state() >= state::stopping;
+    // receivers that still hold a message this pass, their later messages wait behind it
+    std::vector<uint32_t> held;
+    for (auto iter = blocked_.begin(); iter != blocked_.end();)
+    {
+        auto receiver = iter->msg->receiver();
+        if (std::find(held.begin(), held.end(), receiver) != held.end())
+        {
+            ++iter;
+            continue;
+        }
+
+        if (!stopping && now <= iter->deadline && iter->mb->full())
+        {
+            held.emplace_back(receiver);
+            ++iter;
+            continue;
+        }
+
+        if (stopping || now > iter->deadline)
+        {
+            iter->mb->drop();
+            CONSOLE_WARN(router_->get_logger(), "message to service [%X] dropped: mailbox blocked over %" PRId64 "ms.", receiver, mailbox::block_timeout);
+        }
+        else
+        {
+            iter->mb->push();
+            iter->target->send(std::move(iter->msg));
+        }
+
+        if (auto c = blocked_count_.find(receiver); --c->second == 0)
+        {
+            blocked_count_.erase(c);
+        }
+        iter = blocked_.erase(iter);
+    }
+}
+
+void worker::drain_local()
+{
+    swaplocal_.clear();
+    swaplocal_.swap(local_);
+
+    service* ser = nullptr;
+    for (auto& msg : swaplocal_)
+    {
+        handle_one(ser, std::move(msg));
+    }
+}
+
+void worker::resume_suspended()
+{
+    size_t n = 0;
+    for (auto serviceid : suspended_)
+    {
+        // removed, or migrated away and resumed by its new worker
+        auto ser = find_service(serviceid);
+        if (nullptr == ser || !ser->suspended())
+        {
+            continue;
+        }
+
+        ser->resume_dispatch();
+        if (ser->suspended())
+        {
+            suspended_[n++] = serviceid;
+        }
+    }
+    suspended_.resize(n);
+}
+
+void worker::account(int64_t busy)
+{
+    busy_time_ += busy;
+    auto now = time::microsecond();
+    if (window_begin_ == 0)
+    {
+        window_begin_ = now;
+        return;
+    }
+
+    auto elapsed = now - window_begin_;
+    if (elapsed < load_window)
+    {
+        return;
+    }
+
+    // smoothed over two windows, so one long dispatch does not flip placement
+    auto permille = static_cast<uint32_t>(std::min<int64_t>(busy_time_ * 1000 / elapsed, 1000));
+    load_.store((load_.load(std::memory_order_relaxed) + permille) / 2, std::memory_order_relaxed);
+    load_time_.store(now, std::memory_order_relaxed);
+
+    size_t memory = 0;
+    for_each_service([&memory](service* s) {
+        memory += s->memory_use();
+    });
+    memory_.store(memory, std::memory_order_relaxed);
+
+    busy_time_ = 0;
+    window_begin_ = now;
+}
+
+uint32_t worker::cpu_load() const
+{
+    // a parked worker does not close its window, it has been idle since
+    if (time::microsecond() - load_time_.load(std::memory_order_relaxed) > 2 * load_window)
+    {
+        return 0;
+    }
+    return load_.load(std::memory_order_relaxed);
+}
+
+size_t worker::mailbox_size() const
+{
+    return mq_.size() + pmq_.size();
+}
+
+size_t worker::memory() const
+{
+    return memory_.load(std::memory_order_relaxed);
+}
+
+uint8_t worker::id() const
+{
+    return workerid_;
+}
+
+uint8_t worker::pool() const
+{
+    return pool_;
+}
+
+service* worker::find_service(uint32_t serviceid) const
+{
+    if (auto slot = slot_of(serviceid); nullptr != slot)
+    {
+        return slot->service.get();
+    }
+
+    if (guests_.empty())
+    {
+        return nullptr;
+    }
+
+    auto iter = guests_.find(serviceid);
+    if (guests_.end() != iter)
+    {
+        return iter->second.get();
+    }
+    return nullptr;
+}
+
+service_ptr_t* worker::find_owner(uint32_t serviceid)
+{
+    if (auto slot = slot_of(serviceid); nullptr != slot)
+    {
+        return slot->service ? &slot->service : nullptr;
+    }
+
+    auto iter = guests_.find(serviceid);
+    if (guests_.end() != iter)
+    {
+        return &iter->second;
+    }
+    return nullptr;
+}
+
+worker::service_slot* worker::slot_of(uint32_t serviceid)
+{
+    return const_cast<service_slot*>(static_cast<const worker*>(this)->slot_of(serviceid));
+}
+
+const worker::service_slot* worker::slot_of(uint32_t serviceid) const
+{
+    if (((serviceid >> WORKER_ID_SHIFT) & 0xFF) != workerid_)
+    {
+        return nullptr;
+    }
+
+    auto idx = serviceid & SERVICE_SLOT_MASK;
+    if (idx >= slots_.size())
+    {
+        return nullptr;
+    }
+
+    auto& slot = slots_[idx];
+    if (slot.generation != ((serviceid >> SERVICE_SLOT_BITS) & SERVICE_GENERATION_MASK))
+    {
+        return nullptr;
+    }
+    return &slot;
+}
+
+uint32_t worker::count() const
+{
+    return count_.load(std::memory_order_acquire);
+}
+
+uint32_t worker::pending() const
+{
+    return pending_.load(std::memory_order_acquire);
+}
+
+uint64_t worker::quantum_exceeded() const
+{
+    return quantum_exceeded_.load(std::memory_order_relaxed);
+}
+
+uint64_t worker::deferred() const
+{
+    return deferred_count_.load(std::memory_order_relaxed);
+}
+
+worker* worker::forward_worker(uint32_t serviceid) const
+{
+    if (auto slot = slot_of(serviceid); nullptr != slot)
+    {
+        return (slot->forward != 0) ? router_->get_worker(slot->forward) : nullptr;
+    }
+
+    auto iter = forwards_.find(serviceid);
+    if (forwards_.end() != iter)
+    {
+        return router_->get_worker(iter->second);
+    }
+    return nullptr;
+}
+
+void worker::shared(bool v)
+{
+    shared_ = v;
+}
+
+bool worker::shared() const
+{
+    return shared_.load();
+}
+
+bool worker::is_current() const
+{
+    return current_ == this;
+}
+
+worker* worker::current()
+{
+    return current_;
+}
+
+void worker::start()
+{
+    post(start_command{});
+}
+
+void worker::colocate(uint32_t serviceid, uint32_t peer)
+{
+    post(colocate_command{ serviceid, peer });
+}
+
+void worker::handle_command(colocate_command& cmd)
+{
+    if (nullptr != find_service(cmd.peer))
+    {
+        router_->migrate_service(cmd.serviceid, id());
+    }
+    else if (auto w = forward_worker(cmd.peer); nullptr != w)
+    {
+        w->colocate(cmd.serviceid, cmd.peer);
+    }
+    else
+    {
+        CONSOLE_WARN(router_->get_logger(), "colocate service [%X] failed: peer [%X] not found.", cmd.serviceid, cmd.peer);
+    }
+}
+
+void worker::shed_services(uint8_t target, uint32_t count)
+{
+    post(shed_services_command{ target, count });
+}
+
+void worker::handle_command(shed_services_command& cmd)
+{
+    std::vector<uint32_t> ids;
+    for_each_service([&ids, &cmd](service* s) {
+        if (ids.size() < cmd.count)
         {
-            auto& s = it.second;
-            if (s->is_ok() && s->id() != msg->sender())
+            ids.emplace_back(s->id());
+        }
+    });
+
+    for (auto serviceid : ids)
+    {
+        move_service(serviceid, cmd.target);
+    }
+}
+
+void worker::retire()
+{
+    retired_.store(true, std::memory_order_release);
+    post(retire_command{});
+}
+
+bool worker::revive()
+{
+    // under the lock finish_retire() ends the thread with
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (state_.load(std::memory_order_acquire) == state::exited)
+    {
+        return false;
+    }
+    retired_.store(false, std::memory_order_release);
+    return true;
+}
+
+bool worker::restart()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (state_.load(std::memory_order_acquire) != state::exited || !retired())
+        {
+            return false;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(thread_mutex_);
+    // the old thread closed the loop on its way out
+    if (thread_.joinable())
+    {
+        thread_.join();
+    }
+
+    open_loop();
+    signals_.store(0, std::memory_order_release);
+    sleeping_.store(false, std::memory_order_release);
+    idle_until_ = 0;
+    retired_.store(false, std::memory_order_release);
+    state_.store(state::init, std::memory_order_release);
+    init();
+    return true;
+}
+
+bool worker::retired() const
+{
+    return retired_.load(std::memory_order_acquire);
+}
+
+void worker::handle_command(retire_command&)
+{
+    if (!shared())
+    {
+        retired_.store(false, std::memory_order_release);
+        CONSOLE_WARN(router_->get_logger(), "[WORKER %u] retire failed: worker is not shared.", id());
+        return;
+    }
+
+    std::vector<uint32_t> ids;
+    for_each_service([&ids](service* s) {
+        ids.emplace_back(s->id());
+    });
+
+    size_t moved = 0;
+    for (auto serviceid : ids)
+    {
+        auto target = router_->next_worker(pool_);
+        if (nullptr == target || target == this || target->retired() || target->pool() != pool_ || !target->shared())
+        {
+            CONSOLE_WARN(router_->get_logger(), "[WORKER %u] retire stopped: no worker left in the pool.", id());
+            break;
+        }
+
+        if (move_service(serviceid, target->id()))
+        {
+            ++moved;
+        }
+    }
+
+    CONSOLE_INFO(router_->get_logger(), "[WORKER %u] retired, %zu of %zu services moved away.", id(), moved, ids.size());
+    finish_retire();
+}
+
+void worker::finish_retire()
+{
+    if (!retired() || count() != 0 || !guests_.empty() || !forwards_.empty())
+    {
+        return;
+    }
+
+    // ids this worker allocated are still in use elsewhere, their stray messages come here
+    for (auto& slot : slots_)
+    {
+        if (slot.service || slot.forward != 0)
+        {
+            return;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!retired())
+        {
+            return;
+        }
+        state_.store(state::exited, std::memory_order_release);
+    }
+    CONSOLE_INFO(router_->get_logger(), "[WORKER %u] retired, nothing is left to forward, the thread stops.", id());
+}
+
+void worker::handle_command(start_command&)
+{
+    for_each_service([](service* s) {
+        s->start();
+    });
+}
+
+void worker::handle_one(service*& ser, message_ptr_t&& msg, bool priority)
+{
+    // copies deferred for suspended services carry their receiver, see below
+    if (msg->broadcast() && msg->receiver() == 0)
+    {
+        for_each_service([this, &msg](service* s) {
+            if (!s->is_ok() || s->id() == msg->sender())
             {
-                s->handle_message(std::forward<message_ptr_t>(msg));
+                return;
             }
-        }
+
+            // a service finishes its cut dispatch first, like with any other message
+            if (s->suspended())
+            {
+                auto m = message::create(static_cast<const buffer_ptr_t&>(*msg));
+                m->set_sender(msg->sender());
+                m->set_receiver(s->id());
+                if (msg->header_id() != 0)
+                {
+                    m->set_header_id(msg->header_id());
+                }
+                else
+                {
+                    m->set_header(msg->header());
+                }
+                m->set_type(msg->type());
+                m->set_subtype(msg->subtype());
+                m->set_sessionid(msg->sessionid());
+                deferred_.emplace_back(std::move(m));
+                deferred_count_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            s->handle_message(std::forward<message_ptr_t>(msg));
+        });
         return;
     }
 
@@ -325,14 +1356,88 @@ void worker::handle_one(service*& ser, message_ptr_t&& msg)
         ser = find_service(msg->receiver());
         if (nullptr == ser)
         {
+            if (auto w = forward_worker(msg->receiver()); nullptr != w)
+            {
+                w->send(std::move(msg));
+                return;
+            }
+
             if (msg->sender() != 0)
             {
                 msg->set_sessionid(-msg->sessionid());
-                router_->response(msg->sender(), "worker::handle_one ", format("[%X] attempt send to dead service [%X]: %s.", msg->sender(), msg->receiver(), hex_string({ msg->data(),msg->size() }).data()).data(), msg->sessionid(), PTYPE_ERROR);
+                router_->response(msg->sender(), "worker::handle_one ", format("[%X] attempt send to dead service [%X]: %s.", msg->sender(), msg->receiver(), hex_string(msg->bytes()).data()).data(), msg->sessionid(), PTYPE_ERROR);
             }
             return;
         }
     }
-    ser->handle_message(std::forward<message_ptr_t>(msg));
+
+    // a service finishes its cut dispatch before it sees anything else
+    if (ser->suspended() || (!priority && over_quantum(ser)))
+    {
+        deferred_.emplace_back(std::move(msg));
+        deferred_count_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    // broadcasts are not counted in, see router::admit
+    if (auto& mb = ser->mailbox_; nullptr != mb && msg->type() != PTYPE_SYSTEM && msg->type() != PTYPE_ERROR && !msg->broadcast())
+    {
+        // oldest messages go first while a drop_oldest mailbox is over its limit
+        bool drop = (mb->policy() == mailbox_policy::drop_oldest && mb->overrun());
+        mb->pop();
+        if (drop)
+        {
+            mb->drop();
+            return;
+        }
+    }
+
+    if (cfg_.quantum_time > 0)
+    {
+        auto begin_time = time::microsecond();
+        ser->handle_message(std::forward<message_ptr_t>(msg));
+        ser->round_time_ += time::microsecond() - begin_time;
+    }
+    else
+    {
+        ser->handle_message(std::forward<message_ptr_t>(msg));
+    }
+
+    if (ser->suspended())
+    {
+        suspended_.emplace_back(ser->id());
+    }
+    ++ser->round_count_;
     timer_.update();
 }
+
+bool worker::over_quantum(service* ser)
+{
+    if (cfg_.quantum == 0 && cfg_.quantum_time == 0)
+    {
+        return false;
+    }
+
+    if (ser->round_ != round_)
+    {
+        ser->round_ = round_;
+        ser->round_count_ = 0;
+        ser->round_time_ = 0;
+        ser->round_exceeded_ = false;
+        return false;
+    }
+
+    if (ser->round_exceeded_)
+    {
+        return true;
+    }
+
+    if ((cfg_.quantum != 0 && ser->round_count_ >= cfg_.quantum)
+        || (cfg_.quantum_time != 0 && ser->round_time_ >= cfg_.quantum_time))
+    {
+        ser->round_exceeded_ = true;
+        quantum_exceeded_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
@@ -1,28 +1,134 @@
 #pragma once
+#include <variant>
+#include <uv.h>
 #include "config.hpp"
-#include "common/concurrent_queue.hpp"
-#include "common/spinlock.hpp"
+#include "common/mpsc_queue.hpp"
+#include "mailbox.hpp"
 #include "worker_timer.hpp"
 
 class server;
 class router;
 
+// a named group of workers, services that declare the pool are only placed on them
+struct worker_pool
+{
+    std::string name;
+    uint8_t thread = 0;
+};
+
+struct worker_config
+{
+    // microseconds an idle worker keeps polling without blocking, 0 means block immediately
+    int64_t spin = 0;
+    // messages a service may handle per drain round, 0 means unlimited
+    uint32_t quantum = 0;
+    // microseconds a service may run per drain round, 0 means unlimited
+    int64_t quantum_time = 0;
+    // cpu set of each worker, indexed by workerid - 1, empty means not pinned
+    std::vector<std::vector<int>> cpus;
+    // numa node whose memory each worker prefers, indexed like cpus, -1 means none
+    std::vector<int> nodes;
+    // milliseconds between colocate rounds of the top pairs, 0 leaves colocation to scripts.
+    // every worker arms the timer, router::colocate_round lets one of them run each round
+    int64_t colocate_interval = 0;
+    uint32_t colocate_top = 0;
+    // some thread that spawns workers is pinned, unpinned workers restore the cpus of the process
+    bool restore_cpus = false;
+    // extra pools, their workers are created after the default pool's
+    std::vector<worker_pool> pools;
+};
+
 class worker
 {
-    using queue_t = concurrent_queue<message_ptr_t, spin_lock, std::vector>;
+    using queue_t = mpsc_queue<message_ptr_t, std::vector>;
 
     using command_hander_t = std::function<std::string(const std::vector<std::string>&)>;
 
-    using task_t = std::function<void()>;
+    // bits of signals_, hot wakeups that carry no payload
+    enum signal : uint32_t
+    {
+        signal_drain = 1 << 0,
+    };
+
+    struct add_service_command
+    {
+        std::string service_type;
+        std::string config;
+        bool unique;
+        uint32_t creatorid;
+        int32_t sessionid;
+    };
+
+    struct remove_service_command
+    {
+        uint32_t serviceid;
+        uint32_t sender;
+        uint32_t sessionid;
+    };
+
+    struct migrate_service_command
+    {
+        uint32_t serviceid;
+        uint8_t target;
+    };
+
+    struct adopt_service_command
+    {
+        service_ptr_t service;
+        worker_timer::timer_list_t timers;
+    };
+
+    // update the forwarding entry of a service this worker allocated, target 0 erases it
+    struct forward_service_command
+    {
+        uint32_t serviceid;
+        uint8_t target;
+    };
+
+    // migrate a service to the worker hosting peer, resolved through forwarding entries
+    struct colocate_command
+    {
+        uint32_t serviceid;
+        uint32_t peer;
+    };
+
+    // migrate up to count services to the target worker
+    struct shed_services_command
+    {
+        uint8_t target;
+        uint32_t count;
+    };
+
+    // migrate every service away, the thread stays to forward messages of the ids it allocated
+    struct retire_command {};
+
+    struct start_command {};
+
+    struct stop_command {};
+
+    using command_t = std::variant<add_service_command, remove_service_command, migrate_service_command, adopt_service_command, forward_service_command, colocate_command, shed_services_command, retire_command, start_command, stop_command>;
+
+    // a service allocated by this worker, the slot index and generation are part of its id
+    struct service_slot
+    {
+        service_ptr_t service;
+        uint32_t generation = 0;
+        // worker hosting the service after it migrated away, 0 if none
+        uint8_t forward = 0;
+    };
 
 public:
-    static constexpr uint16_t max_uuid = 0xFFFF;
+    // messages buffered for one destination worker before they are handed over early
+    static constexpr size_t max_outbound = 64;
+
+    // microseconds of one cpu load sample
+    static constexpr int64_t load_window = 100000;
 
     friend class server;
 
     friend class socket;
 
-    explicit worker(server* server, router* router, uint8_t id);
+    explicit worker(server* server, router* router, uint8_t id, uint8_t pool, const worker_config& cfg);
 
     ~worker();
 
@@ -34,18 +140,82 @@ public:
 
     uint8_t id() const;
 
-    uint32_t uuid();
+    // index of the pool this worker belongs to, 0 is the default pool
+    uint8_t pool() const;
 
     void add_service(std::string service_type, std::string config, bool unique, uint32_t creatorid, int32_t sessionid);
 
+    // move a service to another shared worker, its timers and queued messages follow it
+    void migrate_service(uint32_t serviceid, uint8_t target);
+
     void send(message_ptr_t&& msg);
 
+    // messages for services of this worker, pushed to its mailbox at once. batch is left empty
+    void send_batch(std::vector<message_ptr_t>& batch);
+
+    // move a service next to peer, post to the worker that allocated peer
+    void colocate(uint32_t serviceid, uint32_t peer);
+
+    // move up to count services to another worker of the pool
+    void shed_services(uint8_t target, uint32_t count);
+
+    // stop taking new services and move the current ones away
+    void retire();
+
+    // take new services again, false if the retired thread already ended
+    bool revive();
+
+    bool retired() const;
+
+    // the thread ended, after stop or once retired with nothing left
+    bool stoped() const;
+
     void shared(bool v);
 
     bool shared() const;
 
+    // called from the worker's own thread
+    bool is_current() const;
+
+    // the worker running on the calling thread, nullptr for other threads
+    static worker* current();
+
+    // hand every buffered outbound message to its destination worker, worker thread only
+    void flush_outbound();
+
+    // hand over the messages buffered for target only, worker thread only
+    void flush_outbound(worker* target);
+
+    // hold a message for a full block mailbox instead of waiting for room, worker thread only
+    void block(message_ptr_t&& msg, mailbox_ptr_t mb, worker* target);
+
+    // messages for receiver are held, later ones must queue behind them
+    bool blocked(uint32_t receiver) const;
+
     worker_timer& timer() { return timer_; }
 
+    // event loop of the worker thread, handles on it must be used from that thread only
+    uv_loop_t* loop() { return &loop_; }
+
+    uint32_t count() const;
+
+    // services posted to this worker and not created yet
+    uint32_t pending() const;
+
+    // times a service was cut by the quantum, and messages requeued because of it
+    uint64_t quantum_exceeded() const;
+
+    uint64_t deferred() const;
+
+    // busy time of the recent load windows in permille
+    uint32_t cpu_load() const;
+
+    // messages waiting in the mailbox
+    size_t mailbox_size() const;
+
+    // memory of the hosted services, sampled with the cpu load
+    size_t memory() const;
+
 private:
     void init();
 
@@ -53,34 +223,223 @@ private:
 
     void wait();
 
-    bool stoped() const;
+    // start the thread of a retired worker that ended again, false if it is not such a worker
+    bool restart();
+
+    // init the handles of the loop, in the constructor and again by restart
+    void open_loop();
+
+    // destroy the services left, then close every handle on the loop, worker thread only once it ran
+    void close_loop();
 
 private:
     void start();
 
-    void update();
+    void post(command_t&& cmd);
+
+    void signal(uint32_t s);
+
+    // one pass over commands, messages and timers, run by the loop callbacks
+    void run_once();
+
+    // keep the loop from blocking while work is left, arm the timer for the next deadline
+    void schedule();
+
+    void run_commands();
+
+    void drain();
+
+    // take a batch of messages from another worker in one splice
+    void receive(queue_t::container_type& batch);
+
+    // buffer a message for another worker, worker thread only
+    void outbound(worker* target, message_ptr_t&& msg);
+
+    // handle every queued control message, return the number handled
+    size_t drain_priority();
+
+    // handle the messages services of this worker sent to each other so far,
+    // the ones they send meanwhile wait for the next call
+    void drain_local();
+
+    // continue the dispatches cut by their cpu budget, before the round hands out messages
+    void resume_suspended();
+
+    // send the held messages whose mailbox has room, drop the ones held over mailbox::block_timeout
+    void release_blocked();
+
+    // add the busy time of one loop iteration, close the load window when due
+    void account(int64_t busy);
+
+    // control messages take the priority lane and are not cut by the quantum
+    static bool is_priority(uint8_t type)
+    {
+        return type == PTYPE_SYSTEM || type == PTYPE_ERROR || type == PTYPE_DEBUG;
+    }
+
+    void handle_command(add_service_command& cmd);
+
+    void handle_command(remove_service_command& cmd);
+
+    // handle the messages queued so far, then the removals waiting for them
+    void run_removals();
+
+    void remove_now(remove_service_command& cmd);
+
+    // handle the deferred messages of a service being removed, regardless of its quantum
+    void flush_deferred(uint32_t serviceid);
 
-    void handle_one(service*& ser, message_ptr_t&& msg);
+    void handle_command(migrate_service_command& cmd);
+
+    // false if the service is not hosted here or can not move to target
+    bool move_service(uint32_t serviceid, uint8_t target);
+
+    void handle_command(adopt_service_command& cmd);
+
+    void handle_command(forward_service_command& cmd);
+
+    void handle_command(colocate_command& cmd);
+
+    void handle_command(shed_services_command& cmd);
+
+    void handle_command(retire_command& cmd);
+
+    // end the thread of a retired worker once nothing is hosted or forwarded through it
+    void finish_retire();
+
+    void handle_command(start_command& cmd);
+
+    void handle_command(stop_command& cmd);
+
+    void handle_one(service*& ser, message_ptr_t&& msg, bool priority = false);
+
+    bool over_quantum(service* ser);
 
     service* find_service(uint32_t serviceid) const;
 
+    // owner of a hosted service, own slot or guest, nullptr if not hosted here
+    service_ptr_t* find_owner(uint32_t serviceid);
+
+    // slot of an id this worker allocated, nullptr for foreign or stale ids
+    service_slot* slot_of(uint32_t serviceid);
+
+    const service_slot* slot_of(uint32_t serviceid) const;
+
+    // O(1) id allocation from the free slots, 0 if every slot is taken
+    uint32_t alloc_id();
+
+    // the slot is reused with the next generation, stale ids stop matching
+    void free_id(uint32_t serviceid);
+
+    template<typename Handler>
+    void for_each_service(Handler&& handler)
+    {
+        for (auto& slot : slots_)
+        {
+            if (slot.service)
+            {
+                handler(slot.service.get());
+            }
+        }
+
+        for (auto& it : guests_)
+        {
+            handler(it.second.get());
+        }
+    }
+
+    // the worker now hosting a service that moved away, nullptr if unknown
+    worker* forward_worker(uint32_t serviceid) const;
+
 private:
+    // the worker running on this thread, nullptr for other threads
+    inline static thread_local worker* current_ = nullptr;
+
     std::atomic<state> state_ = state::init;
     std::atomic_bool shared_ = true;
-    // to prevent post too many update event
-    std::atomic_flag update_state_ = ATOMIC_FLAG_INIT;
+    std::atomic_bool retired_ = false;
     std::atomic_uint32_t count_ = 0;
-    uint32_t uuid_ = 0;
-    int64_t cpu_time_ = 0;
+    // counted before the add command is posted, so placement sees a burst before it runs
+    std::atomic_uint32_t pending_ = 0;
+    // pending signal bits, a bit already set means the worker is woken for it
+    std::atomic_uint32_t signals_ = 0;
+    // the loop is about to poll or polling, set by prepare_ and cleared by check_
+    std::atomic_bool sleeping_ = false;
+    std::atomic_bool has_task_ = false;
+    std::atomic_uint64_t quantum_exceeded_ = 0;
+    std::atomic_uint64_t deferred_count_ = 0;
+    // drain round counter, services compare it with their own to reset the quantum
+    uint64_t round_ = 0;
+    // load accounting, written by the worker thread only
+    int64_t busy_time_ = 0;
+    int64_t window_begin_ = 0;
+    std::atomic<uint32_t> load_ = 0;
+    std::atomic<int64_t> load_time_ = 0;
+    std::atomic<size_t> memory_ = 0;
+    worker_config cfg_;
     uint8_t workerid_;
+    uint8_t pool_;
     router* router_;
     server* server_;
-    std::deque<task_t> queue_;
+    std::vector<command_t> queue_;
+    std::vector<command_t> swapqueue_;
+    // removals wait for the end of the drain round, behind the messages sent before them
+    std::vector<remove_service_command> removals_;
+    std::vector<remove_service_command> swapremovals_;
     std::thread thread_;
     queue_t mq_;
     queue_t::container_type swapmq_;
+    // priority lane, drained before and in between the messages of mq_
+    queue_t pmq_;
+    queue_t::container_type swappmq_;
+    // messages between services of this worker, only touched by its own thread
+    queue_t::container_type local_;
+    queue_t::container_type swaplocal_;
+    // messages for other workers indexed by workerid, flushed every loop iteration
+    std::vector<queue_t::container_type> outbound_;
+    std::vector<uint8_t> outbound_targets_;
+    // messages of services over quantum, handled first in the next round
+    queue_t::container_type deferred_;
+    // messages held for full block mailboxes, in send order
+    struct blocked_message
+    {
+        message_ptr_t msg;
+        mailbox_ptr_t mb;
+        worker* target;
+        int64_t deadline;
+    };
+    std::deque<blocked_message> blocked_;
+    // receiver -> messages held for it
+    std::unordered_map<uint32_t, uint32_t> blocked_count_;
+    // services with a suspended dispatch
+    std::vector<uint32_t> suspended_;
     worker_timer timer_;
-    std::unordered_map<uint32_t, service_ptr_t> services_;
+    // indexed by the slot bits of the ids this worker allocated
+    std::vector<service_slot> slots_;
+    // freed slots are reused first in first out, so a generation comes back as late as possible
+    std::deque<uint32_t> free_slots_;
+    // services allocated by other workers that migrated here
+    std::unordered_map<uint32_t, service_ptr_t> guests_;
+    // guests that migrated away again: serviceid -> hosting workerid
+    std::unordered_map<uint32_t, uint8_t> forwards_;
     std::unordered_map<std::string, command_hander_t> commands_;
     std::mutex mutex_;
+    // guards thread_ between wait and restart
+    std::mutex thread_mutex_;
+    // the worker thread runs this loop, so lluv handles of its services can share it
+    uv_loop_t loop_;
+    // wakes the loop for commands and signals of other threads
+    uv_async_t async_;
+    // fires at the next worker_timer deadline
+    uv_timer_t timer_handle_;
+    // fires every worker_config::colocate_interval, not initialized when it is 0
+    uv_timer_t colocate_handle_;
+    // makes the loop poll without blocking while work is left
+    uv_idle_t idle_;
+    // marks the loop sleeping right before it polls
+    uv_prepare_t prepare_;
+    // runs run_once after every poll, so sends of lluv callbacks are drained and flushed
+    uv_check_t check_;
+    // the idle handle stays active until then, see worker_config::spin
+    int64_t idle_until_ = 0;
 };
@@ -3,24 +3,29 @@
 
 class worker_timer :public base_timer<worker_timer>
 {
-    static constexpr int MAX_TIMER_NUM = (1 << 24) - 1;
-
     using timer_handler_t = std::function<void(timer_id_t, uint32_t, bool)>;
 
     friend class base_timer<worker_timer>;
 
     struct worker_timer_context : public timer_context
     {
-        worker_timer_context(int32_t duration, int32_t times, uint32_t sid)
+        worker_timer_context(int32_t duration, int32_t times, uint32_t sid, timer_id_t tid)
             : timer_context(duration, times)
             , serviceid(sid)
+            , id(tid)
         {
         }
 
         uint32_t serviceid;
+        // the id the service knows, unique among the timers of the service
+        timer_id_t id;
+        // handed over to another worker, the key left in the wheel is dropped when it fires
+        bool extracted = false;
     };
 
 public:
+    using timer_list_t = std::vector<worker_timer_context>;
+
     timer_id_t repeat(int32_t duration, int32_t times, uint32_t serviceid)
     {
         if (!on_timer_)
@@ -35,34 +40,22 @@ public:
 
         assert(times < worker_timer_context::times_mask);
 
-        if (uuid_ == 0 || uuid_ == MAX_TIMER_NUM)
-        {
-            uuid_ = 1;
-        }
-
-        while (timers_.find(uuid_) != timers_.end())
-        {
-            ++uuid_;
-        }
-
         if (times <= 0)
         {
             times = (0 | worker_timer_context::infinite);
         }
 
-        timer_id_t id = uuid_;
-        insert_timer(duration, id);
-        timers_.emplace(id, worker_timer_context{ duration,times,serviceid });
+        timer_id_t id = create_timerid(serviceid);
+        add(worker_timer_context{ duration,times,serviceid,id });
         return id;
     }
 
-    void remove(timer_id_t timerid)
+    void remove(timer_id_t timerid, uint32_t serviceid)
     {
-        auto iter = timers_.find(timerid);
-        if (iter != timers_.end())
+        auto iter = handles_.find(make_id(serviceid, timerid));
+        if (iter != handles_.end())
         {
-            iter->second.set_flag(worker_timer_context::removed);
-            return;
+            timers_.at(iter->second).set_flag(worker_timer_context::removed);
         }
     }
 
@@ -71,45 +64,100 @@ public:
         on_timer_ = v;
     }
 
-private:
-    timer_id_t create_timerid()
+    // detach every timer of a service, used to hand them over to another worker
+    timer_list_t extract(uint32_t serviceid)
     {
-        if (uuid_ == 0 || uuid_ == MAX_TIMER_NUM)
+        timer_list_t res;
+        for (auto& it : timers_)
         {
-            uuid_ = 1;
+            auto& ctx = it.second;
+            if (ctx.serviceid == serviceid && !ctx.extracted)
+            {
+                res.emplace_back(ctx);
+                handles_.erase(make_id(serviceid, ctx.id));
+                // the handle stays taken until its wheel key fires, so it is never confused with a new timer
+                ctx.extracted = true;
+            }
         }
+        return res;
+    }
 
-        while (timers_.find(uuid_) != timers_.end())
+    // timers restart with their full duration and keep the ids their service knows
+    void adopt(timer_list_t& timers)
+    {
+        for (auto& ctx : timers)
         {
-            ++uuid_;
+            add(ctx);
         }
-        return uuid_;
     }
 
-    int32_t on_timer(timer_id_t id)
+private:
+    static uint64_t make_id(uint32_t serviceid, timer_id_t timerid)
     {
-        auto iter = timers_.find(id);
+        return (static_cast<uint64_t>(serviceid) << 32) | timerid;
+    }
+
+    void add(const worker_timer_context& ctx)
+    {
+        // the wheel holds local handles, ids of migrated timers may be taken here
+        uint32_t handle = 0;
+        do
+        {
+            handle = ++handle_seq_;
+        } while (handle == 0 || timers_.find(handle) != timers_.end());
+
+        timers_.emplace(handle, ctx);
+        handles_.emplace(make_id(ctx.serviceid, ctx.id), handle);
+        insert_timer(ctx.duration(), handle);
+    }
+
+    timer_id_t create_timerid(uint32_t serviceid)
+    {
+        // the service's timers all live on this worker, including those it brought along
+        timer_id_t id = 0;
+        do
+        {
+            id = ++uuid_;
+        } while (id == 0 || handles_.find(make_id(serviceid, id)) != handles_.end());
+        return id;
+    }
+
+    int32_t on_timer(timer_id_t handle)
+    {
+        auto iter = timers_.find(handle);
         if (iter == timers_.end())
         {
             return 0;
         }
 
         auto&ctx = iter->second;
+        if (ctx.extracted)
+        {
+            timers_.erase(iter);
+            return 0;
+        }
+
         if (!ctx.has_flag(worker_timer_context::removed))
         {
-            on_timer_(id, ctx.serviceid, false);
+            on_timer_(ctx.id, ctx.serviceid, false);
             if (ctx.has_flag(worker_timer_context::infinite) || ctx.times(ctx.times() - 1))
             {
                 return ctx.duration();
             }
         }
-        on_timer_(id, ctx.serviceid, true);
-        timers_.erase(iter);
+        on_timer_(ctx.id, ctx.serviceid, true);
+        // the callback may have added timers, iter is not valid after a rehash
+        handles_.erase(make_id(ctx.serviceid, ctx.id));
+        timers_.erase(handle);
         return 0;
     }
 
 private:
     uint32_t uuid_ = 0;
+    uint32_t handle_seq_ = 0;
+    // local handle -> timer
     std::unordered_map<uint32_t, worker_timer_context> timers_;
+    // serviceid << 32 | timer id -> local handle
+    std::unordered_map<uint64_t, uint32_t> handles_;
     timer_handler_t on_timer_;
 };
@@ -4,6 +4,7 @@
 #include "common/file.hpp"
 #include "common/string.hpp"
 #include "common/platform.hpp"
+#include "common/affinity.hpp"
 #include "core/server.h"
 #include "core/server_config.hpp"
 #include "services/lua_service.h"
@@ -191,6 +192,9 @@ int main(int argc, char* argv[])
         return 3;
     }
 
+    // before any thread is pinned, unpinned workers go back to these cpus
+    affinity::save_process_cpus();
+
     std::shared_ptr<server> server_ = std::make_shared<server>();
     wk_server = server_;
 
@@ -204,8 +208,60 @@ int main(int argc, char* argv[])
     router_->register_service("lua", []()->service_ptr_t {
         return std::make_unique<lua_service>();
     });
+    router_->set_traffic_sample(static_cast<uint32_t>(c->traffic_sample > 0 ? c->traffic_sample : 0));
+
+    worker_config wcfg;
+    wcfg.spin = c->spin;
+    wcfg.quantum = static_cast<uint32_t>(c->quantum);
+    wcfg.quantum_time = c->quantum_time;
+    // the rounds act on the sampled matrix, without samples there is nothing to move
+    if (c->colocate_interval > 0 && c->colocate_top > 0 && c->traffic_sample > 0)
+    {
+        wcfg.colocate_interval = c->colocate_interval;
+        wcfg.colocate_top = static_cast<uint32_t>(c->colocate_top);
+    }
 
-    server_->init(c->thread, c->log);
+    size_t worker_num = c->thread;
+    for (const auto& pool : c->pools)
+    {
+        wcfg.pools.emplace_back(worker_pool{ pool.name, static_cast<uint8_t>(pool.thread) });
+        worker_num += static_cast<uint8_t>(pool.thread);
+    }
+
+    for (size_t i = 0; i < worker_num; ++i)
+    {
+        std::vector<int> cpus;
+        int node = -1;
+        if (i < c->numa.size())
+        {
+            cpus = affinity::numa_node_cpus(c->numa[i]);
+            node = cpus.empty() ? -1 : c->numa[i];
+        }
+        if (i < c->cpus.size() && c->cpus[i] >= 0)
+        {
+            cpus = { c->cpus[i] };
+            node = affinity::cpu_node(c->cpus[i]);
+        }
+        wcfg.restore_cpus = wcfg.restore_cpus || !cpus.empty();
+        wcfg.cpus.emplace_back(std::move(cpus));
+        wcfg.nodes.emplace_back(node);
+    }
+
+    // workers spawned at runtime by the pinned main thread must not inherit its cpu
+    wcfg.restore_cpus = wcfg.restore_cpus || c->main_cpu >= 0;
+
+    if (c->logger_cpu >= 0)
+    {
+        affinity::bind(server_->get_logger()->native_handle(), { c->logger_cpu });
+    }
+
+    server_->init(c->thread, c->log, wcfg);
+
+    // after the workers are spawned, they must not inherit the main thread's cpu
+    if (c->main_cpu >= 0)
+    {
+        affinity::bind_current({ c->main_cpu });
+    }
     server_->get_logger()->set_level(c->loglevel);
 
     for (auto& s : c->services)
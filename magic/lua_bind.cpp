@@ -31,7 +31,7 @@ const lua_bind& lua_bind::bind_timer(lua_service* service) const
     lua.set_function("remove_timer", [service](timer_id_t timerid)
     {
         auto& timer = service->get_worker()->timer();
-        timer.remove(timerid);
+        timer.remove(timerid, service->id());
     });
 
     return *this;
@@ -101,6 +101,23 @@ static void register_lua_print(sol::table& lua, logger* log, uint32_t serviceid)
     lua_setglobal(lua.lua_state(), "print");
 }
 
+// the contiguous payload of m to modify, raises a lua error for a chained or empty message
+static buffer* check_buffer(lua_State* L, message* m)
+{
+    if (m->chain())
+    {
+        luaL_error(L, "message payload is chained, read it with msg:chain()");
+        return nullptr;
+    }
+
+    auto buf = m->unique_buffer();
+    if (nullptr == buf)
+    {
+        luaL_error(L, "message has no buffer");
+    }
+    return buf;
+}
+
 const lua_bind& lua_bind::bind_util() const
 {
     lua.set_function("second", time::second);
@@ -108,6 +125,14 @@ const lua_bind& lua_bind::bind_util() const
     lua.set_function("microsecond", time::microsecond);
     lua.set_function("time_offset", time::offset);
 
+    // compare msg:header_id() with the id instead of comparing header strings
+    lua.set_function("intern", [](std::string_view s) {
+        return header_table::instance().intern(s);
+    });
+    lua.set_function("header_name", [](uint16_t id) {
+        return header_table::instance().name(id);
+    });
+
     /*
     lua.set_function("sha1", [](std::string_view s) {
         std::string buf(sha1::sha1_context::digest_size, '\0');
@@ -167,7 +192,7 @@ const lua_bind& lua_bind::bind_message() const
         auto m = sol::stack::get<message*>(L, 1);
         size_t len = 0;
         auto data = luaL_checklstring(L, 2, &len);
-        m->get_buffer()->write_front(data, len);
+        check_buffer(L, m)->write_front(data, len);
         return 0;
     };
 
@@ -176,7 +201,7 @@ const lua_bind& lua_bind::bind_message() const
         auto m = sol::stack::get<message*>(L, 1);
         size_t len = 0;
         auto data = luaL_checklstring(L, 2, &len);
-        m->get_buffer()->write_back(data, len);
+        check_buffer(L, m)->write_back(data, len);
         return 0;
     };
 
@@ -185,7 +210,7 @@ const lua_bind& lua_bind::bind_message() const
         auto m = sol::stack::get<message*>(L, 1);
         auto pos = static_cast<int>(luaL_checkinteger(L, 2));
         auto origin = static_cast<buffer::seek_origin>(luaL_checkinteger(L, 3));
-        m->get_buffer()->seek(pos, origin);
+        check_buffer(L, m)->seek(pos, origin);
         return 0;
     };
 
@@ -193,25 +218,69 @@ const lua_bind& lua_bind::bind_message() const
     {
         auto m = sol::stack::get<message*>(L, 1);
         auto offset = static_cast<int>(luaL_checkinteger(L, 2));
-        m->get_buffer()->offset_writepos(offset);
+        check_buffer(L, m)->offset_writepos(offset);
         return 0;
     };
 
+    // a chained payload is not contiguous, reading it as bytes would silently see nothing
+    auto bytes = [](lua_State* L)->int
+    {
+        auto m = sol::stack::get<message*>(L, 1);
+        if (m->chain())
+        {
+            return luaL_error(L, "message payload is chained, read it with msg:chain()");
+        }
+        auto bytes = m->bytes();
+        lua_pushlstring(L, bytes.data(), bytes.size());
+        return 1;
+    };
+
+    auto substr = [](lua_State* L)->int
+    {
+        auto m = sol::stack::get<message*>(L, 1);
+        if (m->chain())
+        {
+            return luaL_error(L, "message payload is chained, read it with msg:chain()");
+        }
+        auto pos = luaL_checkinteger(L, 2);
+        auto len = luaL_optinteger(L, 3, -1);
+        auto bytes = m->bytes();
+        if (pos < 0 || static_cast<size_t>(pos) > bytes.size())
+        {
+            return luaL_error(L, "substr position %d out of range", static_cast<int>(pos));
+        }
+        auto sub = bytes.substr(static_cast<size_t>(pos), (len < 0) ? string_view_t::npos : static_cast<size_t>(len));
+        lua_pushlstring(L, sub.data(), sub.size());
+        return 1;
+    };
+
     auto cstring = [](lua_State* L)->int
     {
         auto m = sol::stack::get<message*>(L, -1);
-        lua_pushlightuserdata(L, (void*)(m->data()));
-        lua_pushinteger(L, m->size());
+        if (m->chain())
+        {
+            return luaL_error(L, "message payload is chained, read it with msg:chain()");
+        }
+        auto bytes = m->bytes();
+        lua_pushlightuserdata(L, (void*)(bytes.data()));
+        lua_pushinteger(L, bytes.size());
         return 2;
     };
 
     auto tobuffer = [](lua_State* L)->int
     {
         auto m = sol::stack::get<message*>(L, -1);
-        lua_pushlightuserdata(L, (void*)m->get_buffer());
+        // seri.unpack_one moves the read position of what it gets
+        lua_pushlightuserdata(L, (void*)check_buffer(L, m));
         return 1;
     };
 
+    auto tochain = [](lua_State* L)->int
+    {
+        auto m = sol::stack::get<message*>(L, -1);
+        return sol::stack::push(L, m->chain());
+    };
+
     auto redirect = [](lua_State* L)->int
     {
         auto m = sol::stack::get<message*>(L, 1);
@@ -256,10 +325,12 @@ const lua_bind& lua_bind::bind_message() const
         "sessionid", (&message::sessionid),
         "subtype", (&message::subtype),
         "header", (&message::header),
-        "bytes", (&message::bytes),
+        "header_id", (&message::header_id),
+        "bytes", bytes,
         "size", (&message::size),
-        "substr", (&message::substr),
+        "substr", substr,
         "buffer", tobuffer,
+        "chain", tochain,
         "redirect", redirect,
         "resend", resend,
         "cstring", cstring,
@@ -280,12 +351,37 @@ const lua_bind& lua_bind::bind_service(lua_service* service) const
     lua.set_function("id", &lua_service::id, service);
     lua.set_function("set_cb", &lua_service::set_callback, service);
     lua.set_function("send", &router::send, router_);
+    lua.set_function("send_chain", &router::send_chain, router_);
     lua.set_function("new_service", &router::new_service, router_);
     lua.set_function("remove_service", &router::remove_service, router_);
+    lua.set_function("migrate_service", &router::migrate_service, router_);
     lua.set_function("broadcast", &router::broadcast, router_);
+    lua.set_function("subscribe", [service, router_](const std::string& topic) {
+        return router_->subscribe(service->id(), topic);
+    });
+    lua.set_function("unsubscribe", [service, router_](const std::string& topic) {
+        return router_->unsubscribe(service->id(), topic);
+    });
+    lua.set_function("publish", &router::publish, router_);
+    lua.set_function("multicast", [router_](uint32_t sender, const sol::table& receivers, buffer_ptr_t buf, std::string_view header, uint8_t type) {
+        std::vector<uint32_t> ids;
+        ids.reserve(receivers.size());
+        for (size_t i = 1, n = receivers.size(); i <= n; ++i)
+        {
+            ids.emplace_back(receivers.raw_get<uint32_t>(i));
+        }
+        router_->multicast(sender, ids, buf, header, type);
+    });
     lua.set_function("queryservice", &router::get_unique_service, router_);
     lua.set_function("set_env", &router::set_env, router_);
     lua.set_function("get_env", &router::get_env, router_);
+    lua.set_function("worker_info", &router::worker_info, router_);
+    lua.set_function("mailbox_info", &router::mailbox_info, router_);
+    lua.set_function("add_worker", &router::add_worker, router_);
+    lua.set_function("retire_worker", &router::retire_worker, router_);
+    lua.set_function("set_traffic_sample", &router::set_traffic_sample, router_);
+    lua.set_function("traffic_info", &router::traffic_info, router_);
+    lua.set_function("colocate", &router::colocate, router_);
     lua.set_function("set_loglevel", (void(logger::*)(string_view_t))&logger::set_level, router_->get_logger());
     lua.set_function("abort", &server::stop, server_);
     lua.set_function("now", &server::now, server_);
@@ -307,6 +403,16 @@ void lua_bind::registerlib(lua_State* state, const char* name, const sol::table&
     lua_pop(state, 2); /* pop 'package' and 'loaded' tables */
 }
 
+void lua_bind::preload(lua_State* state, const char* name, lua_CFunction function, void* upvalue)
+{
+    lua_getglobal(state, "package");
+    lua_getfield(state, -1, "preload"); /* get 'package.preload' */
+    lua_pushlightuserdata(state, upvalue);
+    lua_pushcclosure(state, function, 1);
+    lua_setfield(state, -2, name); /* package.preload[name] = f */
+    lua_pop(state, 2); /* pop 'package' and 'preload' tables */
+}
+
 const char* lua_traceback(lua_State* state)
 {
     luaL_traceback(state, state, NULL, 1);
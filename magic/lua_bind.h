@@ -34,6 +34,9 @@ public:
 
     static void registerlib(lua_State* state, const char *name, const sol::table& module);
 
+    // loaded on first require, function gets upvalue as its first upvalue
+    static void preload(lua_State* state, const char* name, lua_CFunction function, void* upvalue);
+
 private:
     sol::table& lua;
 };
@@ -9,18 +9,28 @@ extern "C" {
 #include "common/message.hpp"
 #include "sol.hpp"
 
+// metatable of buffers owned by full userdata, created by seri.pack and seri.concat
+constexpr const char* LUA_BUFFER_METATABLE = "buffer_ptr";
+
+// metatable of chains owned by full userdata, created by seri.chain
+constexpr const char* LUA_CHAIN_METATABLE = "buffer_chain_ptr";
+
+// defined in lua_serialize.cpp
+void lua_serialize_push_chain(lua_State* L, buffer_chain_ptr_t chain);
+
 template <typename Handler>
 inline static bool sol_lua_check(sol::types<buffer_ptr_t>, lua_State* L, int index, Handler&& handler, sol::stack::record& tracking)
 {
     sol::type t = sol::type_of(L, index);
-    if (t == sol::type::lua_nil || t == sol::type::lightuserdata || t == sol::type::string)
+    if (t == sol::type::lua_nil || t == sol::type::lightuserdata || t == sol::type::string
+        || (t == sol::type::userdata && nullptr != luaL_testudata(L, index, LUA_BUFFER_METATABLE)))
     {
         tracking.use(1);
         return true;
     }
     else
     {
-        handler(L, index, sol::type::lightuserdata, t, "expected nil or a  lightuserdata(buffer*) or a string");
+        handler(L, index, sol::type::lightuserdata, t, "expected nil, a buffer userdata, a lightuserdata(buffer*) or a string");
         return false;
     }
 }
@@ -45,13 +55,30 @@ inline static buffer_ptr_t sol_lua_get(sol::types<buffer_ptr_t>, lua_State* L, i
         }
         case sol::type::lightuserdata:
         {
+            // takes one more reference, a buffer borrowed from a message stays valid
             buffer* p = static_cast<buffer*>(lua_touserdata(L, index));
             return buffer_ptr_t(p);
         }
+        case sol::type::userdata:
+        {
+            // the message shares the buffer without a copy, so the same userdata can be sent again.
+            // it is read only while a message holds it, seri.unpack_one refuses it until then
+            auto p = static_cast<buffer_ptr_t*>(luaL_testudata(L, index, LUA_BUFFER_METATABLE));
+            if (nullptr != p)
+            {
+                if (!*p)
+                {
+                    luaL_error(L, "buffer userdata is empty");
+                    return nullptr;
+                }
+                return *p;
+            }
+            break;
+        }
         default:
             break;
     }
-    luaL_error(L, "expected nil or a  lightuserdata(buffer*) or a string");
+    luaL_error(L, "expected nil, a buffer userdata, a lightuserdata(buffer*) or a string");
     return nullptr;
 }
 
@@ -63,3 +90,38 @@ inline static int sol_lua_push(sol::types<buffer_ptr_t>, lua_State* L, const buf
     }
     return sol::stack::push(L, (const char*)buf->data(), buf->size());
 }
+
+template <typename Handler>
+inline static bool sol_lua_check(sol::types<buffer_chain_ptr_t>, lua_State* L, int index, Handler&& handler, sol::stack::record& tracking)
+{
+    if (nullptr != luaL_testudata(L, index, LUA_CHAIN_METATABLE))
+    {
+        tracking.use(1);
+        return true;
+    }
+    handler(L, index, sol::type::userdata, sol::type_of(L, index), "expected a buffer chain");
+    return false;
+}
+
+inline static buffer_chain_ptr_t sol_lua_get(sol::types<buffer_chain_ptr_t>, lua_State* L, int index, sol::stack::record& tracking)
+{
+    tracking.use(1);
+    // shared like buffers, appending is refused while a message still holds the chain
+    auto p = static_cast<buffer_chain_ptr_t*>(luaL_testudata(L, index, LUA_CHAIN_METATABLE));
+    if (nullptr == p || !*p)
+    {
+        luaL_error(L, "expected a buffer chain");
+        return nullptr;
+    }
+    return *p;
+}
+
+inline static int sol_lua_push(sol::types<buffer_chain_ptr_t>, lua_State* L, const buffer_chain_ptr_t& chain)
+{
+    if (nullptr == chain)
+    {
+        return sol::stack::push(L, sol::lua_nil);
+    }
+    lua_serialize_push_chain(L, chain);
+    return 1;
+}
@@ -4,10 +4,14 @@ extern "C" {
 #include "lualib.h"
 }
 
+#include <new>
 #include "common/buffer.hpp"
 #include "common/buffer_view.hpp"
+#include "common/buffer_chain.hpp"
 
-static constexpr int32_t HEAP_BUFFER = 1;
+// metatables of buffers and chains owned by full userdata, must match lua_buffer.hpp
+static constexpr const char* BUFFER_METATABLE = "buffer_ptr";
+static constexpr const char* CHAIN_METATABLE = "buffer_chain_ptr";
 static constexpr int32_t WORKER_ID_SHIFT = 24;
 static constexpr int64_t UPDATE_INTERVAL = 10; // ms
 static constexpr int32_t BUFFER_HEAD_RESERVED = 14; // max : websocket header  max  len
@@ -206,7 +210,6 @@ static void wb_table(lua_State* L, buffer* buf, int index, int depth)
 
 static void pack_one(lua_State* L, buffer* b, int index, int depth) {
     if (depth > MAX_DEPTH) {
-        if (b->has_flag(HEAP_BUFFER)) delete b;
         luaL_error(L, "serialize can't pack too depth table");
         return;
     }
@@ -246,19 +249,20 @@ static void pack_one(lua_State* L, buffer* b, int index, int depth) {
         break;
     }
     default:
-        if (b->has_flag(HEAP_BUFFER)) delete b;
         luaL_error(L, "Unsupport type %s to serialize", lua_typename(L, type));
     }
 }
 
-static void invalid_stream_line(lua_State* L, buffer_view* buf, int line) {
+template<class View>
+static void invalid_stream_line(lua_State* L, View* buf, int line) {
     int len = (int)buf->size();
     luaL_error(L, "Invalid serialize stream %d (line:%d)", len, line);
 }
 
 #define invalid_stream(L,rb) invalid_stream_line(L,rb,__LINE__)
 
-static lua_Integer get_integer(lua_State* L, buffer_view* buf, int cookie) {
+template<class View>
+static lua_Integer get_integer(lua_State* L, View* buf, int cookie) {
     switch (cookie) {
     case TYPE_NUMBER_ZERO:
         return 0;
@@ -292,31 +296,44 @@ static lua_Integer get_integer(lua_State* L, buffer_view* buf, int cookie) {
     }
 }
 
-static double get_real(lua_State* L, buffer_view* buf) {
+template<class View>
+static double get_real(lua_State* L, View* buf) {
     double n;
     if (!buf->read(&n))
         invalid_stream(L, buf);
     return n;
 }
 
-static void* get_pointer(lua_State* L, buffer_view* buf) {
+template<class View>
+static void* get_pointer(lua_State* L, View* buf) {
     void* userdata = 0;
     if (!buf->read(&userdata))
         invalid_stream(L, buf);
     return userdata;
 }
 
-static void get_buffer(lua_State* L, buffer_view* buf, int len) {
+template<class View>
+static void get_buffer(lua_State* L, View* buf, int len) {
     if (int(buf->size()) < len) {
         invalid_stream(L, buf);
     }
-    lua_pushlstring(L, buf->data(), len);
-    buf->skip(len);
+    if (buf->contiguous() >= size_t(len)) {
+        lua_pushlstring(L, buf->data(), len);
+        buf->skip(len);
+        return;
+    }
+    // a string straddling chain segments
+    luaL_Buffer b;
+    char* p = luaL_buffinitsize(L, &b, len);
+    buf->read(p, len);
+    luaL_pushresultsize(&b, len);
 }
 
-static void unpack_one(lua_State* L, buffer_view* buf);
+template<class View>
+static void unpack_one(lua_State* L, View* buf);
 
-static void unpack_table(lua_State* L, buffer_view* buf, int array_size) {
+template<class View>
+static void unpack_table(lua_State* L, View* buf, int array_size) {
     if (array_size == MAX_COOKIE - 1) {
         uint8_t type{};
         if (!buf->read(&type))
@@ -345,7 +362,8 @@ static void unpack_table(lua_State* L, buffer_view* buf, int array_size) {
     }
 }
 
-static void push_value(lua_State* L, buffer_view* buf, int type, int cookie)
+template<class View>
+static void push_value(lua_State* L, View* buf, int type, int cookie)
 {
     switch (type) {
     case TYPE_NIL:
@@ -397,13 +415,165 @@ static void push_value(lua_State* L, buffer_view* buf, int type, int cookie)
     }
 }
 
-static void unpack_one(lua_State* L, buffer_view* buf) {
+template<class View>
+static void unpack_one(lua_State* L, View* buf) {
     uint8_t type{};
     if (!buf->read(&type))
         invalid_stream(L, buf);
     push_value(L, buf, type & 0x7, type >> 3);
 }
 
+static int buffer_gc(lua_State* L)
+{
+    auto p = static_cast<intrusive_ptr<buffer>*>(luaL_checkudata(L, 1, BUFFER_METATABLE));
+    p->~intrusive_ptr();
+    return 0;
+}
+
+// push a full userdata holding a reference to buf. messages sent with it and chains linking it
+// share the buffer, nothing modifies it while they hold it
+static buffer* push_buffer(lua_State* L, intrusive_ptr<buffer> buf)
+{
+    auto p = new (lua_newuserdata(L, sizeof(intrusive_ptr<buffer>))) intrusive_ptr<buffer>(std::move(buf));
+    if (luaL_newmetatable(L, BUFFER_METATABLE))
+    {
+        lua_pushcfunction(L, buffer_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    return p->get();
+}
+
+static buffer* new_buffer(lua_State* L)
+{
+    return push_buffer(L, intrusive_ptr<buffer>::make(64, BUFFER_HEAD_RESERVED));
+}
+
+// a buffer userdata or a lightuserdata(buffer*), nullptr otherwise
+static buffer* to_buffer(lua_State* L, int index)
+{
+    if (lua_type(L, index) == LUA_TLIGHTUSERDATA)
+    {
+        return static_cast<buffer*>(lua_touserdata(L, index));
+    }
+    auto p = static_cast<intrusive_ptr<buffer>*>(luaL_testudata(L, index, BUFFER_METATABLE));
+    return (nullptr != p) ? p->get() : nullptr;
+}
+
+static intrusive_ptr<buffer_chain>* check_chain(lua_State* L, int index)
+{
+    auto p = static_cast<intrusive_ptr<buffer_chain>*>(luaL_checkudata(L, index, CHAIN_METATABLE));
+    if (!*p)
+    {
+        luaL_error(L, "buffer chain is empty");
+    }
+    return p;
+}
+
+static int chain_gc(lua_State* L)
+{
+    auto p = static_cast<intrusive_ptr<buffer_chain>*>(luaL_checkudata(L, 1, CHAIN_METATABLE));
+    p->~intrusive_ptr();
+    return 0;
+}
+
+// chain:append(...), strings are copied, buffer userdata are shared and linked without a copy,
+// small ones are copied
+static int chain_append(lua_State* L)
+{
+    auto& chain = *check_chain(L, 1);
+    // a chain still referenced by a message may be read by another thread
+    if (chain->use_count() != 1)
+    {
+        return luaL_error(L, "buffer chain is shared, can not append");
+    }
+
+    int n = lua_gettop(L);
+    for (int i = 2; i <= n; i++) {
+        if (lua_type(L, i) == LUA_TSTRING) {
+            size_t sz = 0;
+            const char* str = lua_tolstring(L, i, &sz);
+            chain->append(str, sz);
+        }
+        else if (lua_type(L, i) == LUA_TLIGHTUSERDATA) {
+            // borrowed from a message, the extra reference keeps it alive
+            chain->append(intrusive_ptr<buffer>(static_cast<buffer*>(lua_touserdata(L, i))));
+        }
+        else {
+            auto p = static_cast<intrusive_ptr<buffer>*>(luaL_testudata(L, i, BUFFER_METATABLE));
+            if (nullptr == p) {
+                return luaL_error(L, "chain append expects string or buffer, got %s", luaL_typename(L, i));
+            }
+            if (!*p) {
+                return luaL_error(L, "buffer userdata is empty");
+            }
+            // shared, like a sent buffer
+            chain->append(*p);
+        }
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int chain_size(lua_State* L)
+{
+    auto& chain = *check_chain(L, 1);
+    lua_pushinteger(L, static_cast<lua_Integer>(chain->size()));
+    return 1;
+}
+
+// contiguous copy as a buffer userdata, for consumers that can not read segments
+static int chain_flatten(lua_State* L)
+{
+    auto& chain = *check_chain(L, 1);
+    push_buffer(L, chain->flatten(BUFFER_HEAD_RESERVED));
+    return 1;
+}
+
+// write the segments to an io file one by one, chain:write_file(io.open(path, "wb"))
+static int chain_write_file(lua_State* L)
+{
+    auto& chain = *check_chain(L, 1);
+    auto stream = static_cast<luaL_Stream*>(luaL_checkudata(L, 2, LUA_FILEHANDLE));
+    if (nullptr == stream->closef)
+    {
+        return luaL_error(L, "attempt to use a closed file");
+    }
+
+    auto ok = chain->write([stream](const char* data, size_t len) {
+        return fwrite(data, 1, len, stream->f) == len;
+    });
+    return luaL_fileresult(L, ok ? 1 : 0, nullptr);
+}
+
+// push a full userdata holding a reference to chain
+void lua_serialize_push_chain(lua_State* L, intrusive_ptr<buffer_chain> chain)
+{
+    new (lua_newuserdata(L, sizeof(intrusive_ptr<buffer_chain>))) intrusive_ptr<buffer_chain>(std::move(chain));
+    if (luaL_newmetatable(L, CHAIN_METATABLE))
+    {
+        luaL_Reg l[] = {
+            {"append", chain_append},
+            {"size", chain_size},
+            {"flatten", chain_flatten},
+            {"write_file", chain_write_file},
+            {NULL, NULL},
+        };
+        lua_pushcfunction(L, chain_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_createtable(L, 0, 4);
+        luaL_setfuncs(L, l, 0);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+}
+
+static int new_chain(lua_State* L)
+{
+    lua_serialize_push_chain(L, intrusive_ptr<buffer_chain>::make());
+    return 1;
+}
+
 static int pack(lua_State* L)
 {
     int n = lua_gettop(L);
@@ -411,14 +581,13 @@ static int pack(lua_State* L)
     {
         return 0;
     }
-    auto buf = new buffer(64, BUFFER_HEAD_RESERVED);
-    buf->set_flag(HEAP_BUFFER);
 
+    // owned by the userdata before anything can raise an error
+    auto buf = new_buffer(L);
     for (int i = 1; i <= n; i++) {
         pack_one(L, buf, i, 0);
     }
-    buf->clear_flag(HEAP_BUFFER);
-    lua_pushlightuserdata(L, buf);
+    lua_settop(L, n + 1);
     return 1;
 }
 
@@ -440,6 +609,9 @@ static int packsafe(lua_State* L)
 
 int lua_serialize_do_unpack(lua_State* L, const char* data, size_t len);
 
+template<class View>
+static int unpack_all(lua_State* L, View& br);
+
 static int unpack(lua_State* L)
 {
     if (lua_isnoneornil(L, 1)) {
@@ -450,9 +622,16 @@ static int unpack(lua_State* L)
     if (lua_type(L, 1) == LUA_TSTRING) {
         data = lua_tolstring(L, 1, &len);
     }
+    else if (auto chain = static_cast<intrusive_ptr<buffer_chain>*>(luaL_testudata(L, 1, CHAIN_METATABLE)); nullptr != chain)
+    {
+        // read segment by segment, without flattening
+        if (!*chain || (*chain)->empty()) return 0;
+        buffer_chain_view br(**chain);
+        return unpack_all(L, br);
+    }
     else
     {
-        buffer* buf = (buffer*)lua_touserdata(L, 1);
+        buffer* buf = to_buffer(L, 1);
         if (nullptr == buf) return 0;
         data = buf->data();
         len = buf->size();
@@ -466,12 +645,16 @@ static int unpack_one(lua_State* L)
         return 0;
     }
 
-    if (lua_type(L, 1) != LUA_TLIGHTUSERDATA)
+    buffer* buf = to_buffer(L, 1);
+    if (nullptr == buf)
     {
         return luaL_error(L, "need userdata");
     }
-
-    buffer* buf = (buffer*)lua_touserdata(L, 1);
+    // other holders may read it on another thread, the read position must not move under them
+    if (buf->use_count() > 1)
+    {
+        return luaL_error(L, "buffer is shared, unpack_one can not consume it");
+    }
     buffer_view br(buf->data(), buf->size());
 
     uint8_t type = 0;
@@ -497,9 +680,14 @@ int lua_serialize_do_unpack(lua_State* L, const char* data, size_t len)
         return luaL_error(L, "deserialize null pointer");
     }
 
-    lua_settop(L, 1);
-
     buffer_view br(data, len);
+    return unpack_all(L, br);
+}
+
+template<class View>
+static int unpack_all(lua_State* L, View& br)
+{
+    lua_settop(L, 1);
 
     for (int i = 0;; i++)
     {
@@ -542,7 +730,6 @@ static void concat_table(lua_State* L, buffer* buf, int index, int depth)
 static void concat_one(lua_State* L, buffer* b, int index, int depth)
 {
     if (depth > MAX_DEPTH) {
-        if (b->has_flag(HEAP_BUFFER)) delete b;
         luaL_error(L, "serialize can't concat too depth table");
         return;
     }
@@ -588,7 +775,6 @@ static void concat_one(lua_State* L, buffer* b, int index, int depth)
         break;
     }
     default:
-        if (b->has_flag(HEAP_BUFFER)) delete b;
         luaL_error(L, "Unsupport type %s to concat", lua_typename(L, type));
     }
 }
@@ -600,13 +786,11 @@ static int concat(lua_State* L)
     {
         return 0;
     }
-    auto buf = new buffer(64, BUFFER_HEAD_RESERVED);
-    buf->set_flag(HEAP_BUFFER);
+    auto buf = new_buffer(L);
     for (int i = 1; i <= n; i++) {
         concat_one(L, buf, i, 0);
     }
-    buf->clear_flag(HEAP_BUFFER);
-    lua_pushlightuserdata(L, buf);
+    lua_settop(L, n + 1);
     return 1;
 }
 
@@ -638,6 +822,7 @@ extern "C"
             {"unpack_one",unpack_one},
             {"concat",concat },
             {"concats",concatsafe },
+            {"chain",new_chain },
             {NULL,NULL},
         };
         luaL_newlib(L, l);
@@ -2,6 +2,7 @@
 #include "lua_service_config.hpp"
 #include "common/message.hpp"
 #include "common/hash.hpp"
+#include "common/time.hpp"
 #include "core/server.h"
 #include "core/worker.h"
 #include "core/server_config.hpp"
@@ -45,6 +46,47 @@ void* lua_service::lalloc(void* ud, void* ptr, size_t osize, size_t nsize)
     }
 }
 
+void lua_service::budget_hook(lua_State* L, lua_Debug*)
+{
+    void* ud = nullptr;
+    lua_getallocf(L, &ud);
+    lua_service* l = reinterpret_cast<lua_service*>(ud);
+    if (l->deadline_ == 0 || time::millisecond() < l->deadline_)
+    {
+        return;
+    }
+
+    // a yield passes every pcall of the dispatch, the kill policy then drops the coroutine.
+    // coroutines created by lua code are not ours to yield: a yield there would return to the
+    // script's resume, so even the yield policy raises the budget error in them
+    if (L == l->co_ && lua_isyieldable(L))
+    {
+        l->co_yielded_ = true;
+        lua_yield(L, 0);
+        return;
+    }
+
+    // not yieldable here, e.g. inside a c call. the deadline stays, so once back in
+    // the dispatch coroutine the hook yields even if a pcall swallowed this error
+    luaL_error(L, "dispatch exceeded cpu budget %d ms", static_cast<int>(l->budget));
+}
+
+// loads lluv on the loop of the worker hosting the service, which is then bound to that worker
+int lua_service::open_lluv(lua_State* L)
+{
+    auto l = static_cast<lua_service*>(lua_touserdata(L, lua_upvalueindex(1)));
+    luaopen_lluv(L);
+    lua_getfield(L, -1, "set_loop");
+    if (!lua_isfunction(L, -1))
+    {
+        return luaL_error(L, "lluv can not run on the worker loop: set_loop missing");
+    }
+    lua_pushlightuserdata(L, l->worker_->loop());
+    lua_call(L, 1, 0);
+    l->loop_bound_ = true;
+    return 1;
+}
+
 lua_service::lua_service()
     : lua_(sol::default_at_panic, lalloc, this)
 {
@@ -72,6 +114,39 @@ bool lua_service::init(std::string_view config)
 
     mem_limit = static_cast<size_t>(conf.get_value<int64_t>("memlimit"));
 
+    if (auto limit = conf.get_value<int64_t>("mailbox"); limit > 0)
+    {
+        mailbox_policy policy;
+        auto policy_name = conf.get_value<std::string>("mailbox_policy");
+        if (!mailbox::parse_policy(policy_name, policy))
+        {
+            CONSOLE_ERROR(get_logger(), "lua service init failed: unknown mailbox policy '%s'.", policy_name.data());
+            return false;
+        }
+        set_mailbox(static_cast<size_t>(limit), policy);
+    }
+
+    budget = conf.get_value<int64_t>("budget");
+    if (budget > 0)
+    {
+        auto policy_name = conf.get_value<std::string>("budget_policy");
+        if (policy_name.empty() || iequal_string(policy_name, std::string{ "kill" }))
+        {
+            budget_yield = false;
+        }
+        else if (iequal_string(policy_name, std::string{ "yield" }))
+        {
+            budget_yield = true;
+        }
+        else
+        {
+            CONSOLE_ERROR(get_logger(), "lua service init failed: unknown budget policy '%s'.", policy_name.data());
+            return false;
+        }
+        // threads inherit the hook of the main state
+        lua_sethook(lua_.lua_state(), budget_hook, LUA_MASKCOUNT, budget_hook_count);
+    }
+
     lua_.open_libraries();
     sol::table module = lua_.create_table();
     lua_bind lua_bind(module);
@@ -82,7 +157,7 @@ bool lua_service::init(std::string_view config)
             .bind_timer(this);
     lua_bind::registerlib(lua_.lua_state(), "core", module);
     lua_bind::registerlib(lua_.lua_state(), "lfs",  luaopen_lfs);
-    lua_bind::registerlib(lua_.lua_state(), "lluv", luaopen_lluv);
+    lua_bind::preload(lua_.lua_state(), "lluv", open_lluv, this);
     lua_bind::registerlib(lua_.lua_state(), "json", luaopen_cjson);
     lua_bind::registerlib(lua_.lua_state(), "seri", luaopen_serialize);
 
@@ -125,6 +200,13 @@ bool lua_service::init(std::string_view config)
         lua_["package"]["cpath"] = cpath;
     }
 
+    // only services that watch other services' exits, each one costs a message per exit.
+    // subscribed before the script runs, exits during its start are not missed
+    if (conf.get_value<bool>("exit_notice"))
+    {
+        router_->subscribe(id(), std::string{ HEADER_EXIT });
+    }
+
     // sol::protected_function_result call_result = lua_.script_file(luafile, sol::script_pass_on_error);
     sol::load_result load_result = lua_.load_file(luafile);
     if (!load_result.valid())
@@ -191,19 +273,134 @@ void lua_service::dispatch(message* msg)
         return;
     }
 
+    if (budget > 0)
+    {
+        deadline_ = time::millisecond() + budget;
+    }
+
+    // a broadcast message is shared by every service and can not wait for a resume,
+    // the kill policy never resumes
+    if (budget > 0 && !suspended_ && (!budget_yield || !msg->broadcast()))
+    {
+        auto L = lua_.lua_state();
+        if (nullptr == co_)
+        {
+            co_ = lua_newthread(L);
+            co_ref_ = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+        co_msg_ = msg;
+        dispatch_.push(co_);
+        sol::stack::push(co_, msg);
+        sol::stack::push(co_, msg->type());
+        resume_dispatch(2);
+        return;
+    }
+
     auto result = dispatch_(msg, msg->type());
+    deadline_ = 0;
     if (!result.valid())
     {
         sol::error err = result;
-        if (msg->sessionid() >= 0 || msg->receiver() == 0) // socket mesage receiver==0
-        {
-            CONSOLE_ERROR(get_logger(), "%s dispatch:\n%s", name().data(), err.what());
-            return;
-        }
+        dispatch_error(msg, err.what());
+    }
+}
 
-        msg->set_sessionid(-msg->sessionid());
-        router_->response(msg->sender(), "lua_service::dispatch "sv, err.what(), msg->sessionid(), PTYPE_ERROR);
+void lua_service::resume_dispatch(int nargs)
+{
+    co_yielded_ = false;
+    auto status = lua_resume(co_, lua_.lua_state(), nargs);
+    deadline_ = 0;
+    if (status == LUA_YIELD && co_yielded_ && budget_yield)
+    {
+        suspended_ = true;
+        return;
+    }
+
+    auto msg = co_msg_;
+    if (status == LUA_OK)
+    {
+        suspended_ = false;
+        co_msg_ = nullptr;
+        lua_settop(co_, 0);
+        return;
     }
+
+    std::string err;
+    auto L = lua_.lua_state();
+    if (status == LUA_YIELD && co_yielded_)
+    {
+        auto reason = "dispatch exceeded cpu budget " + std::to_string(budget) + " ms";
+        luaL_traceback(L, co_, reason.data(), 0);
+        err = lua_tostring(L, -1);
+        lua_pop(L, 1);
+    }
+    else if (status == LUA_YIELD)
+    {
+        err = "attempt to yield from dispatch";
+    }
+    else
+    {
+        luaL_traceback(L, co_, lua_tostring(co_, -1), 0);
+        err = lua_tostring(L, -1);
+        lua_pop(L, 1);
+    }
+
+    abandon_dispatch();
+    dispatch_error(msg, err.data());
+}
+
+void lua_service::abandon_dispatch()
+{
+    // a dead or killed coroutine can not run again, the next dispatch creates a new one
+    if (nullptr != co_)
+    {
+        luaL_unref(lua_.lua_state(), LUA_REGISTRYINDEX, co_ref_);
+    }
+    co_ = nullptr;
+    co_ref_ = LUA_NOREF;
+    co_msg_ = nullptr;
+    suspended_ = false;
+}
+
+bool lua_service::migratable() const
+{
+    return !loop_bound_;
+}
+
+bool lua_service::suspended() const
+{
+    return suspended_;
+}
+
+void lua_service::resume()
+{
+    if (!suspended_ || !is_ok())
+    {
+        suspended_ = false;
+        co_msg_ = nullptr;
+        return;
+    }
+
+    deadline_ = time::millisecond() + budget;
+    resume_dispatch(0);
+
+    if (!suspended_ && exit_pending_)
+    {
+        exit_pending_ = false;
+        exit();
+    }
+}
+
+void lua_service::dispatch_error(message* msg, const char* err)
+{
+    if (msg->sessionid() >= 0 || msg->receiver() == 0) // socket mesage receiver==0
+    {
+        CONSOLE_ERROR(get_logger(), "%s dispatch:\n%s", name().data(), err);
+        return;
+    }
+
+    msg->set_sessionid(-msg->sessionid());
+    router_->response(msg->sender(), "lua_service::dispatch "sv, err, msg->sessionid(), PTYPE_ERROR);
 }
 
 void lua_service::on_timer(uint32_t timerid, bool remove)
@@ -228,6 +425,13 @@ void lua_service::exit()
         return;
     }
 
+    // the main state does not run while the dispatch waits, exit follows its resume
+    if (suspended_)
+    {
+        exit_pending_ = true;
+        return;
+    }
+
     if (exit_.valid())
     {
         auto result = exit_();
@@ -251,6 +455,9 @@ void lua_service::destroy()
         return;
     }
 
+    // the service goes away, a cut dispatch never finishes
+    abandon_dispatch();
+
     if (destroy_.valid())
     {
         auto result = destroy_();
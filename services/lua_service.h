@@ -21,7 +21,7 @@ public:
 
     ~lua_service();
 
-    size_t memory_use();
+    size_t memory_use() override;
 
     void set_callback(char c, sol_function_t f);
 
@@ -38,14 +38,36 @@ private:
 
     void on_timer(uint32_t timerid, bool remove) override;
 
+    bool migratable() const override;
+
+    bool suspended() const override;
+
+    void resume() override;
+
     void error(const std::string& msg, bool initialized = true);
 
+    void dispatch_error(message* msg, const char* err);
+
+    // run the dispatch coroutine, the budget hook yields it to suspend or to kill it
+    void resume_dispatch(int nargs);
+
+    void abandon_dispatch();
+
     static void* lalloc(void* ud, void* ptr, size_t osize, size_t nsize);
 
+    static void budget_hook(lua_State* L, lua_Debug* ar);
+
+    static int open_lluv(lua_State* L);
+
 public:
     size_t mem = 0;
     size_t mem_limit = 0;
     size_t mem_report = 8 * 1024 * 1024;
+    // milliseconds one dispatch may run, 0 means unlimited
+    int64_t budget = 0;
+    // yield the dispatch back to the worker when the budget runs out, otherwise kill it.
+    // only the dispatch itself yields, a coroutine of the script still running gets the budget error
+    bool budget_yield = false;
 
 private:
     sol::state lua_;
@@ -54,4 +76,17 @@ private:
     sol_function_t exit_;
     sol_function_t destroy_;
     sol_function_t on_timer_;
+    // the budget hook checks the clock every budget_hook_count instructions
+    static constexpr int budget_hook_count = 10000;
+    int64_t deadline_ = 0;
+    // reused by every budgeted dispatch, replaced after an error or a kill
+    lua_State* co_ = nullptr;
+    int co_ref_ = LUA_NOREF;
+    message* co_msg_ = nullptr;
+    bool co_yielded_ = false;
+    bool suspended_ = false;
+    // exit was requested while suspended
+    bool exit_pending_ = false;
+    // lluv was loaded, its handles live on the worker loop
+    bool loop_bound_ = false;
 };
@@ -0,0 +1,33 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "test.hpp"
+
+// replaced in a file of its own, so no call site sees operator new and the free behind
+// operator delete together
+static std::atomic<size_t> allocations = 0;
+
+size_t allocation_count()
+{
+    return allocations.load(std::memory_order_relaxed);
+}
+
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (auto p = std::malloc(size); nullptr != p)
+    {
+        return p;
+    }
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
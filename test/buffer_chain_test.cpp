@@ -0,0 +1,171 @@
+// buffer_chain_view reads values and arrays that straddle segment boundaries,
+// flatten and write hand the same bytes over.
+#include "test.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "common/buffer_chain.hpp"
+
+using chain_ptr = intrusive_ptr<buffer_chain>;
+
+// values 0..count-1 as uint32_t, appended in writes of uneven sizes that end inside values
+static chain_ptr make_chain(uint32_t count)
+{
+    std::vector<uint32_t> values(count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        values[i] = i;
+    }
+
+    auto chain = chain_ptr::make();
+    auto data = reinterpret_cast<const char*>(values.data());
+    size_t size = values.size() * sizeof(uint32_t);
+    size_t step = 1;
+    for (size_t pos = 0; pos < size; pos += step, step = step % 4093 + 7)
+    {
+        chain->append(data + pos, std::min(step, size - pos));
+    }
+    return chain;
+}
+
+static void straddle()
+{
+    constexpr uint32_t count = 100000;
+    auto chain = make_chain(count);
+    assert(chain->size() == count * sizeof(uint32_t));
+    assert(chain->segments().size() > 1);
+
+    buffer_chain_view view(*chain);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t v = 0;
+        assert(view.read(&v));
+        assert(v == i);
+    }
+    assert(view.size() == 0 && view.contiguous() == 0 && nullptr == view.data());
+
+    uint32_t v = 0;
+    assert(!view.read(&v));
+}
+
+static void arrays_and_skip()
+{
+    constexpr uint32_t count = 50000;
+    auto chain = make_chain(count);
+
+    // the first segment holds the values before boundary, start one byte into a value before it
+    assert(chain->segments().front()->size() == buffer_chain::segment_size);
+    size_t boundary = buffer_chain::segment_size / sizeof(uint32_t);
+    buffer_chain_view view(*chain);
+    view.skip((boundary - 3) * sizeof(uint32_t) + 1);
+    assert(view.size() == chain->size() - (boundary - 3) * sizeof(uint32_t) - 1);
+
+    uint8_t rest[3];
+    assert(view.read(rest, 3));
+
+    // an array that straddles the boundary
+    uint32_t values[8] = {};
+    assert(view.read(values, 8));
+    for (uint32_t i = 0; i < 8; ++i)
+    {
+        assert(values[i] == boundary - 2 + i);
+    }
+
+    // a misaligned value made of the last bytes of one segment and the first of the next
+    buffer_chain_view unaligned(*chain);
+    unaligned.skip(boundary * sizeof(uint32_t) - 2);
+    assert(unaligned.contiguous() == 2);
+    uint32_t expected[2] = { static_cast<uint32_t>(boundary - 1), static_cast<uint32_t>(boundary) };
+    uint32_t v = 0;
+    assert(unaligned.read(&v));
+    assert(memcmp(&v, reinterpret_cast<const char*>(expected) + 2, sizeof(v)) == 0);
+
+    // a read past the end fails and leaves the position
+    auto remain = view.size();
+    std::vector<uint32_t> too_many(remain / sizeof(uint32_t) + 1);
+    assert(!view.read(too_many.data(), too_many.size()));
+    assert(view.size() == remain);
+
+    view.skip(remain + 100);
+    assert(view.size() == 0);
+}
+
+static void linked_segments()
+{
+    // small buffers are copied, large ones linked as they are
+    auto small = buffer_chain::buffer_ptr::make(64, 0);
+    uint32_t one = 1;
+    small->write_back(&one, 1);
+
+    auto large = buffer_chain::buffer_ptr::make(buffer_chain::link_size * 2, 0);
+    for (uint32_t i = 2; i < 2 + buffer_chain::link_size / 2; ++i)
+    {
+        large->write_back(&i, 1);
+    }
+
+    auto chain = chain_ptr::make();
+    uint32_t zero = 0;
+    chain->append(reinterpret_cast<const char*>(&zero), 3);
+    chain->append(reinterpret_cast<const char*>(&zero) + 3, 1);
+    chain->append(small);
+    chain->append(buffer_chain::buffer_ptr{});
+    chain->append(large);
+    assert(chain->segments().size() == 2);
+    assert(chain->segments().back().get() == large.get());
+
+    // appended after a linked segment, the chain starts a segment of its own
+    uint32_t last = 2 + buffer_chain::link_size / 2;
+    chain->append(reinterpret_cast<const char*>(&last), sizeof(last));
+    assert(chain->segments().size() == 3);
+    assert(large->size() == buffer_chain::link_size * 2);
+
+    buffer_chain_view view(*chain);
+    for (uint32_t i = 0; i <= last; ++i)
+    {
+        uint32_t v = 0;
+        assert(view.read(&v) && v == i);
+    }
+    assert(view.size() == 0);
+}
+
+static void flatten_and_write()
+{
+    auto chain = make_chain(40000);
+    auto flat = chain->flatten();
+    assert(flat->size() == chain->size());
+
+    std::string written;
+    assert(chain->write([&written](const char* data, size_t len) {
+        written.append(data, len);
+        return true;
+    }));
+    assert(written.size() == flat->size());
+    assert(memcmp(written.data(), flat->data(), flat->size()) == 0);
+
+    // the writer stops at the first segment it does not take
+    size_t calls = 0;
+    assert(!chain->write([&calls](const char*, size_t) {
+        ++calls;
+        return false;
+    }));
+    assert(calls == 1);
+
+    // a single segment is returned as is and never written to again
+    auto single = chain_ptr::make();
+    single->append("abc", 3);
+    auto seg = single->flatten();
+    assert(seg.get() == single->segments().front().get());
+    single->append("def", 3);
+    assert(seg->size() == 3);
+    assert(single->segments().size() == 2);
+}
+
+void buffer_chain_test()
+{
+    straddle();
+    arrays_and_skip();
+    linked_segments();
+    flatten_and_write();
+}
@@ -0,0 +1,119 @@
+// interning from several threads while others look headers up, messages carry interned
+// headers as ids, a full table interns nothing more.
+#include "test.hpp"
+#include <string>
+#include <thread>
+#include <vector>
+#include "common/message.hpp"
+
+static void basics()
+{
+    auto& table = header_table::instance();
+    assert(table.intern("") == 0);
+    assert(table.find("") == 0);
+    assert(table.find("exit") == 0);
+    assert(table.name(0).empty());
+    assert(table.name(header_table::max_count).empty());
+
+    auto id = table.intern("exit");
+    assert(id != 0);
+    assert(table.intern("exit") == id);
+    assert(table.find("exit") == id);
+    assert(table.name(id) == "exit");
+    assert(table.find("exi") == 0);
+}
+
+static void concurrent()
+{
+    auto& table = header_table::instance();
+    constexpr int writer_count = 4;
+    constexpr int name_count = 700;
+
+    std::vector<std::thread> threads;
+    for (int k = 0; k < writer_count; ++k)
+    {
+        // writers intern the same names, each one gets a single id
+        threads.emplace_back([&table] {
+            for (int i = 0; i < name_count * 2; ++i)
+            {
+                auto s = "header." + std::to_string(i % name_count);
+                auto id = table.intern(s);
+                assert(id != 0);
+                assert(table.name(id) == s);
+                assert(table.find(s) == id);
+            }
+        });
+
+        // readers see a name either missing or complete
+        threads.emplace_back([&table] {
+            for (int i = 0; i < name_count * 2; ++i)
+            {
+                auto s = "header." + std::to_string(i % name_count);
+                if (auto id = table.find(s); id != 0)
+                {
+                    assert(table.name(id) == s);
+                }
+            }
+        });
+    }
+
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    for (int i = 0; i < name_count; ++i)
+    {
+        auto s = "header." + std::to_string(i);
+        auto id = table.find(s);
+        assert(id != 0 && table.name(id) == s);
+    }
+}
+
+static void messages()
+{
+    auto id = header_table::instance().intern("lua_service::dispatch");
+
+    auto m = message::create();
+    m->set_header("lua_service::dispatch");
+    assert(m->header_id() == id);
+    assert(m->header() == "lua_service::dispatch");
+
+    m->set_header("not interned");
+    assert(m->header_id() == 0);
+    assert(m->header() == "not interned");
+
+    m->set_header_id(id);
+    assert(m->header() == "lua_service::dispatch");
+}
+
+// last, the table stays full
+static void full()
+{
+    auto& table = header_table::instance();
+    uint16_t last = 0;
+    for (int i = 0;; ++i)
+    {
+        auto id = table.intern("fill." + std::to_string(i));
+        if (id == 0)
+        {
+            break;
+        }
+        assert(id > last && id < header_table::max_count);
+        last = id;
+    }
+    assert(last == header_table::max_count - 1);
+
+    // interned names are still found
+    assert(table.intern("exit") != 0);
+    assert(table.find("fill.0") != 0);
+    assert(table.find("missing") == 0);
+}
+
+void header_table_test()
+{
+    basics();
+    concurrent();
+    messages();
+    full();
+}
@@ -0,0 +1,130 @@
+// mailbox accounting: producers count messages in from several threads, the consumer
+// counts them out, size, high water and the limit checks stay consistent, blocked senders
+// sleep until a pop or the timeout.
+#include "test.hpp"
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "core/mailbox.hpp"
+
+static void policies()
+{
+    mailbox_policy policy = mailbox_policy::block;
+    assert(mailbox::parse_policy("", policy) && policy == mailbox_policy::drop_newest);
+    assert(mailbox::parse_policy("DROP_OLDEST", policy) && policy == mailbox_policy::drop_oldest);
+    assert(mailbox::parse_policy("reject", policy) && policy == mailbox_policy::reject);
+    assert(mailbox::parse_policy("block", policy) && policy == mailbox_policy::block);
+    assert(!mailbox::parse_policy("wait", policy) && policy == mailbox_policy::block);
+
+    for (auto p : { mailbox_policy::drop_newest, mailbox_policy::drop_oldest, mailbox_policy::reject, mailbox_policy::block })
+    {
+        assert(mailbox::parse_policy(mailbox::policy_name(p), policy) && policy == p);
+    }
+}
+
+static void limits()
+{
+    mailbox mb(2, mailbox_policy::drop_oldest);
+    assert(!mb.full() && !mb.overrun());
+    mb.push();
+    mb.push();
+    assert(mb.full() && !mb.overrun());
+    // drop_oldest producers push past the limit, the consumer drops the excess
+    mb.push();
+    assert(mb.overrun());
+    mb.pop();
+    mb.drop();
+    assert(mb.size() == 2 && mb.high_water() == 3 && mb.dropped() == 1);
+    mb.pop();
+    mb.pop();
+    assert(mb.size() == 0 && !mb.full() && mb.high_water() == 3);
+}
+
+static void concurrent()
+{
+    constexpr int producer_count = 4;
+    constexpr int per_producer = 100000;
+    constexpr size_t limit = 64;
+
+    mailbox mb(limit, mailbox_policy::reject);
+    std::atomic<int> admitted = 0;
+    std::atomic<int> done = 0;
+    std::vector<std::thread> producers;
+    for (int p = 0; p < producer_count; ++p)
+    {
+        producers.emplace_back([&] {
+            for (int i = 0; i < per_producer; ++i)
+            {
+                if (mb.full())
+                {
+                    mb.drop();
+                    continue;
+                }
+                mb.push();
+                admitted.fetch_add(1, std::memory_order_release);
+            }
+            done.fetch_add(1, std::memory_order_release);
+        });
+    }
+
+    // every message counted in is counted out once
+    int consumed = 0;
+    while (done.load(std::memory_order_acquire) != producer_count || consumed != admitted.load(std::memory_order_acquire))
+    {
+        if (consumed != admitted.load(std::memory_order_acquire))
+        {
+            mb.pop();
+            ++consumed;
+        }
+    }
+
+    for (auto& t : producers)
+    {
+        t.join();
+    }
+
+    assert(mb.size() == 0);
+    assert(static_cast<uint64_t>(consumed) + mb.dropped() == static_cast<uint64_t>(producer_count) * per_producer);
+    // a producer may pass the full check while the others do, never by more than one each
+    assert(mb.high_water() <= limit + producer_count);
+}
+
+static void blocked_sender()
+{
+    mailbox mb(1, mailbox_policy::block);
+    mb.push();
+
+    // nobody pops, the sender gives up at the timeout
+    auto begin = std::chrono::steady_clock::now();
+    assert(!mb.wait(20, [] { return false; }));
+    assert(std::chrono::steady_clock::now() - begin >= std::chrono::milliseconds(20));
+
+    // a sender that must stop does not wait at all
+    assert(!mb.wait(20, [] { return true; }));
+
+    // the consumer's pop wakes it long before the timeout
+    std::atomic<bool> waiting = false;
+    std::thread consumer([&mb, &waiting] {
+        while (!waiting.load())
+        {
+            std::this_thread::yield();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        mb.pop();
+    });
+
+    begin = std::chrono::steady_clock::now();
+    waiting.store(true);
+    assert(mb.wait(10000, [] { return false; }));
+    assert(std::chrono::steady_clock::now() - begin < std::chrono::seconds(5));
+    consumer.join();
+    assert(mb.size() == 0);
+}
+
+void mailbox_test()
+{
+    policies();
+    limits();
+    concurrent();
+    blocked_sender();
+}
@@ -0,0 +1,29 @@
+#include <cstdio>
+#include "test.hpp"
+
+static const struct
+{
+    const char* name;
+    void (*run)();
+} tests[] = {
+    // first, it expects the message pool of this thread to be empty
+    { "message", message_test },
+    { "mpsc_queue", mpsc_queue_test },
+    { "mailbox", mailbox_test },
+    { "slab", slab_test },
+    { "buffer_chain", buffer_chain_test },
+    // last, it leaves the header table full
+    { "header_table", header_table_test },
+};
+
+int main()
+{
+    for (const auto& t : tests)
+    {
+        // the name of the one running is the last line printed when a check fails
+        printf("%s\n", t.name);
+        t.run();
+    }
+    printf("%zu tests passed\n", sizeof(tests) / sizeof(tests[0]));
+    return 0;
+}
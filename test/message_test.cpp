@@ -0,0 +1,98 @@
+// pooled messages are reused without allocating, a message created for a buffer takes a
+// bare one from the pool.
+#include "test.hpp"
+#include <thread>
+#include <vector>
+#include "common/message.hpp"
+
+static void steady_state()
+{
+    // warm up the pool of this thread
+    for (int i = 0; i < 16; ++i)
+    {
+        auto m = message::create(64);
+        m->set_header("lua_service::dispatch");
+    }
+
+    auto before = allocation_count();
+    for (int i = 0; i < 100000; ++i)
+    {
+        auto m = message::create(64);
+        m->set_header("lua_service::dispatch");
+        m->write_data("hello");
+    }
+    assert(allocation_count() == before);
+}
+
+static void long_header()
+{
+    std::string header(message::header_inline_size * 2, 'h');
+    {
+        auto m = message::create(64);
+        m->set_header(header);
+    }
+
+    // the pooled message kept the capacity of its long header
+    auto before = allocation_count();
+    for (int i = 0; i < 1000; ++i)
+    {
+        auto m = message::create(64);
+        m->set_header(header);
+        assert(m->header() == header);
+    }
+    assert(allocation_count() == before);
+}
+
+static void bring_buffer()
+{
+    // pool a message that keeps its buffer
+    message* pooled = nullptr;
+    buffer* kept = nullptr;
+    {
+        auto m = message::create(64);
+        pooled = m.get();
+        kept = m->get_buffer();
+    }
+
+    // a message created for a buffer must not take that one and throw its buffer away
+    auto buf = message::create_buffer(64);
+    {
+        auto m = message::create(buf);
+        assert(m.get() != pooled);
+        assert(m->get_buffer() == buf.get());
+    }
+
+    auto m = message::create(64);
+    assert(m.get() == pooled);
+    assert(m->get_buffer() == kept);
+}
+
+static void cross_thread()
+{
+    std::vector<message_ptr_t> messages;
+    messages.reserve(1000);
+    for (int round = 0; round < 3; ++round)
+    {
+        auto before = allocation_count();
+        for (int i = 0; i < 1000; ++i)
+        {
+            messages.emplace_back(message::create(64));
+        }
+        // freed by another thread, they go back to the pool of this one
+        std::thread([&messages] { messages.clear(); }).join();
+        if (round != 0)
+        {
+            // only the thread itself allocates
+            assert(allocation_count() - before < 16);
+        }
+    }
+}
+
+void message_test()
+{
+    // first, the pool of this thread holds only the message it makes
+    bring_buffer();
+    steady_state();
+    long_header();
+    cross_thread();
+}
@@ -0,0 +1,101 @@
+// producers push single elements and batches while one consumer drains, every element
+// arrives once and each producer's elements arrive in order.
+#include "test.hpp"
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include "common/mpsc_queue.hpp"
+
+static constexpr uint32_t producer_count = 4;
+
+static constexpr uint32_t per_producer = 200000;
+
+// producer index in the high bits, sequence in the low bits
+static uint64_t make_value(uint32_t producer, uint32_t seq)
+{
+    return (static_cast<uint64_t>(producer) << 32) | seq;
+}
+
+static void single_thread()
+{
+    mpsc_queue<int> q;
+    assert(q.size() == 0 && !q.ready());
+    assert(q.push_back(1) == 1);
+    assert(q.push_back(2) == 2);
+    assert(q.ready());
+
+    int v = 0;
+    assert(q.try_pop(v) && v == 1);
+
+    std::vector<int> batch{ 3, 4, 5 };
+    assert(q.push_batch(batch) == 4);
+    assert(batch.empty());
+
+    std::vector<int> out;
+    q.swap(out);
+    assert((out == std::vector<int>{ 2, 3, 4, 5 }));
+    assert(q.size() == 0 && !q.ready());
+    assert(!q.try_pop(v));
+}
+
+static void concurrent()
+{
+    mpsc_queue<uint64_t> q;
+    std::vector<std::thread> producers;
+    for (uint32_t p = 0; p < producer_count; ++p)
+    {
+        producers.emplace_back([&q, p] {
+            std::vector<uint64_t> batch;
+            for (uint32_t seq = 0; seq < per_producer; ++seq)
+            {
+                // even producers push one by one, odd ones hand over batches like a worker flushing its outbound
+                if (p % 2 == 0)
+                {
+                    q.push_back(make_value(p, seq));
+                    continue;
+                }
+
+                batch.emplace_back(make_value(p, seq));
+                if (batch.size() == 64 || seq + 1 == per_producer)
+                {
+                    q.push_batch(batch);
+                }
+            }
+        });
+    }
+
+    std::vector<uint32_t> next(producer_count, 0);
+    uint64_t total = 0;
+    while (total < static_cast<uint64_t>(producer_count) * per_producer)
+    {
+        auto n = q.consume([&next](uint64_t&& v) {
+            auto p = static_cast<uint32_t>(v >> 32);
+            auto seq = static_cast<uint32_t>(v);
+            assert(p < producer_count);
+            assert(seq == next[p]);
+            next[p] = seq + 1;
+        });
+        total += n;
+        if (n == 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    for (auto& t : producers)
+    {
+        t.join();
+    }
+
+    assert(q.size() == 0 && !q.ready());
+    for (auto n : next)
+    {
+        assert(n == per_producer);
+    }
+}
+
+void mpsc_queue_test()
+{
+    single_thread();
+    concurrent();
+}
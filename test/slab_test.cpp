@@ -0,0 +1,141 @@
+// blocks freed by their own thread or handed back by others are reused by the thread that
+// allocated them, blocks of exited threads stay valid.
+#include "test.hpp"
+#include <cstring>
+#include <set>
+#include <thread>
+#include <vector>
+#include "common/slab.hpp"
+
+static void size_classes()
+{
+    assert(slab_allocator::fit(1) == 64);
+    assert(slab_allocator::fit(64) == 64);
+    assert(slab_allocator::fit(65) == 128);
+    assert(slab_allocator::fit(64 * 1024) == 64 * 1024);
+    // larger than the max class is allocated as is
+    assert(slab_allocator::fit(64 * 1024 + 1) == 64 * 1024 + 1);
+
+    size_t usable = 0;
+    auto p = slab_allocator::allocate(100000, usable);
+    assert(usable == 100000);
+    memset(p, 0, usable);
+    slab_allocator::deallocate(p);
+    slab_allocator::deallocate(nullptr);
+}
+
+static void same_thread()
+{
+    size_t usable = 0;
+    auto p = slab_allocator::allocate(100, usable);
+    assert(usable == 128);
+    memset(p, 1, usable);
+    slab_allocator::deallocate(p);
+
+    auto q = slab_allocator::allocate(120, usable);
+    assert(q == p && usable == 128);
+    slab_allocator::deallocate(q);
+}
+
+static void cross_thread()
+{
+    constexpr size_t count = 4;
+    size_t usable = 0;
+    std::vector<void*> blocks;
+    for (size_t i = 0; i < count; ++i)
+    {
+        blocks.emplace_back(slab_allocator::allocate(1000, usable));
+    }
+    std::set<void*> allocated(blocks.begin(), blocks.end());
+
+    // freed elsewhere, they go to the return list of this thread's cache
+    std::thread([&blocks] {
+        for (auto p : blocks)
+        {
+            slab_allocator::deallocate(p);
+        }
+    }).join();
+
+    // the cache reclaims them once its own free list of the class runs dry
+    for (size_t i = 0; i < count; ++i)
+    {
+        auto p = slab_allocator::allocate(1000, usable);
+        assert(allocated.count(p) == 1);
+        blocks[i] = p;
+    }
+
+    for (auto p : blocks)
+    {
+        slab_allocator::deallocate(p);
+    }
+}
+
+static void exited_owner()
+{
+    std::vector<void*> blocks;
+    std::thread([&blocks] {
+        size_t usable = 0;
+        for (int i = 0; i < 100; ++i)
+        {
+            auto p = slab_allocator::allocate(4000, usable);
+            memset(p, 2, usable);
+            blocks.emplace_back(p);
+        }
+    }).join();
+
+    // the cache of the exited thread is kept for the next one
+    for (auto p : blocks)
+    {
+        slab_allocator::deallocate(p);
+    }
+
+    std::thread([] {
+        size_t usable = 0;
+        auto p = slab_allocator::allocate(4000, usable);
+        memset(p, 3, usable);
+        slab_allocator::deallocate(p);
+    }).join();
+}
+
+static void ping_pong()
+{
+    constexpr int rounds = 200000;
+    std::atomic<void*> slot = nullptr;
+    std::thread consumer([&slot] {
+        for (int i = 0; i < rounds; ++i)
+        {
+            void* p = nullptr;
+            while (nullptr == (p = slot.exchange(nullptr, std::memory_order_acquire)))
+            {
+                std::this_thread::yield();
+            }
+            assert(*static_cast<int*>(p) == i);
+            slab_allocator::deallocate(p);
+        }
+    });
+
+    for (int i = 0; i < rounds; ++i)
+    {
+        size_t usable = 0;
+        auto p = slab_allocator::allocate(sizeof(int) << (i % 10), usable);
+        *static_cast<int*>(p) = i;
+        while (nullptr != slot.load(std::memory_order_relaxed))
+        {
+            std::this_thread::yield();
+        }
+        slot.store(p, std::memory_order_release);
+    }
+    consumer.join();
+}
+
+void slab_test()
+{
+    // on a thread of its own, the reuse checks expect a cache nothing else allocated from
+    std::thread([] {
+        size_classes();
+        same_thread();
+        cross_thread();
+        exited_owner();
+        ping_pong();
+    }).join();
+}
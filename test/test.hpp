@@ -0,0 +1,15 @@
+#pragma once
+// checks stay on in release builds, a failed one aborts the run
+#undef NDEBUG
+#include <cassert>
+#include <cstddef>
+
+void buffer_chain_test();
+void header_table_test();
+void mailbox_test();
+void message_test();
+void mpsc_queue_test();
+void slab_test();
+
+// operator new calls so far, see allocation_counter.cpp
+size_t allocation_count();